@@ -44,13 +44,13 @@ void application(hal::sd::hardware_map_t& p_map)
     // print thr data being written
     (void)hal::delay(clock, 200ms);
 
-    auto block = micro_sd.read_block(0x00000000, read_buffer);
+    micro_sd.read_block(0x00000000, std::span(read_buffer));
 
     // Print first N bytes of read data for verification
     hal::print(console, "Read Data:\n");
     for (size_t i = 0; i < 512;
          i++) {  // Just an example, adjust '10' as per your requirements.
-      hal::print<128>(console, "Data[%d]: %x\n", i, block[i]);
+      hal::print<128>(console, "Data[%d]: %x\n", i, read_buffer[i]);
     }
 
     (void)hal::delay(clock, 500ms);
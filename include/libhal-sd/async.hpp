@@ -0,0 +1,331 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <array>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+#include <libhal/units.hpp>
+
+#include "microsd.hpp"
+
+namespace hal::sd {
+class executor;
+
+/**
+ * @brief Fixed-size slots that coroutine frames are carved from
+ *
+ * Every frame takes one slot, so the memory needed for a set of tasks is known
+ * up front and nothing is taken from the heap.
+ */
+class frame_pool
+{
+public:
+  /// Maximum number of slots a pool can manage
+  static constexpr std::size_t max_frames = 32;
+
+  /**
+   * @param p_memory - storage for the slots, aligned to std::max_align_t
+   * @param p_frame_size - size of each slot in bytes. The compiler decides how
+   * big a coroutine frame is, so leave room for the largest task's locals.
+   */
+  frame_pool(std::span<hal::byte> p_memory, std::size_t p_frame_size);
+
+  /**
+   * @brief Take a free slot
+   *
+   * @param p_size - size of the coroutine frame
+   * @return void* - the frame, or nullptr if no slot is free or p_size does
+   * not fit into one
+   */
+  void* allocate(std::size_t p_size) noexcept;
+
+  /**
+   * @brief Return a frame's slot to the pool it was allocated from
+   *
+   * @param p_frame - frame returned by allocate()
+   */
+  static void release(void* p_frame) noexcept;
+
+  /// Number of slots in the pool
+  std::size_t capacity() const;
+
+  /// Number of slots currently free
+  std::size_t available() const;
+
+private:
+  std::span<hal::byte> m_memory;
+  std::size_t m_frame_size;
+  std::size_t m_capacity;
+  uint32_t m_used = 0;
+};
+
+/// Something a suspended task waits on, checked by the executor every pass
+class async_operation
+{
+public:
+  /**
+   * @brief Make progress without blocking
+   *
+   * @return true - the waiting task can be resumed
+   */
+  virtual bool poll() = 0;
+
+  virtual ~async_operation() = default;
+};
+
+/**
+ * @brief Coroutine type of a job run by an executor
+ *
+ * The first parameter of every task must be the executor that runs it, which
+ * is where the task's frame is allocated from:
+ *
+ *     hal::sd::async_task log_job(hal::sd::executor& p_executor,
+ *                                 hal::sd::microsd_card& p_card);
+ *
+ * Tasks start suspended and only run once handed to executor::spawn().
+ */
+class async_task
+{
+public:
+  /// Promise state shared by every task, whatever its parameters
+  struct promise_base
+  {
+    static async_task get_return_object_on_allocation_failure() noexcept;
+    std::suspend_always initial_suspend() noexcept
+    {
+      return {};
+    }
+    std::suspend_always final_suspend() noexcept
+    {
+      return {};
+    }
+    void return_void() noexcept
+    {
+    }
+    void unhandled_exception();
+
+    /// Operation the task is suspended on, nullptr if it is ready to run
+    async_operation* operation = nullptr;
+
+  protected:
+    static void* allocate(std::size_t p_size, executor& p_executor) noexcept;
+    static void release(void* p_frame) noexcept;
+  };
+
+  /**
+   * @brief Promise of a task taking (executor&, Args...)
+   *
+   * The frame's operator new and delete are plain members of a class made for
+   * the task's exact parameter list. GCC 12 pairs a member template operator
+   * new with a non-template delete as a -Wmismatched-new-delete at -O0, so
+   * neither of the two is a template here.
+   */
+  template<typename... Args>
+  struct promise : promise_base
+  {
+    async_task get_return_object() noexcept
+    {
+      return { std::coroutine_handle<promise>::from_promise(*this), *this };
+    }
+
+    static void* operator new(std::size_t p_size,
+                              executor& p_executor,
+                              Args const&...) noexcept
+    {
+      return allocate(p_size, p_executor);
+    }
+    static void operator delete(void* p_frame) noexcept
+    {
+      release(p_frame);
+    }
+  };
+
+  async_task(async_task&& p_other) noexcept;
+  async_task& operator=(async_task&& p_other) noexcept;
+  async_task(async_task const&) = delete;
+  async_task& operator=(async_task const&) = delete;
+  ~async_task();
+
+private:
+  friend class executor;
+
+  async_task() = default;
+  async_task(std::coroutine_handle<> p_handle, promise_base& p_promise);
+
+  std::coroutine_handle<> m_handle{};
+  promise_base* m_promise = nullptr;
+};
+}  // namespace hal::sd
+
+/// Tasks whose first parameter is not an executor have no promise, as there is
+/// no pool to allocate their frame from.
+template<typename... Args>
+struct std::coroutine_traits<hal::sd::async_task, hal::sd::executor&, Args...>
+{
+  using promise_type = hal::sd::async_task::promise<Args...>;
+};
+
+namespace hal::sd {
+/**
+ * @brief Single-threaded executor that interleaves tasks on one core
+ *
+ * Each pass of run_once() polls the operation every task is suspended on and
+ * resumes the tasks whose operation can make progress. Tasks that run into an
+ * exception they do not catch are destroyed and the exception leaves
+ * run_once().
+ */
+class executor
+{
+public:
+  /**
+   * @param p_frame_memory - storage for task frames, aligned to
+   * std::max_align_t
+   * @param p_frame_size - size of each frame slot in bytes
+   */
+  executor(std::span<hal::byte> p_frame_memory, std::size_t p_frame_size);
+
+  executor(executor const&) = delete;
+  executor& operator=(executor const&) = delete;
+  ~executor();
+
+  /**
+   * @brief Schedule a task to run on the next pass
+   *
+   * @param p_task - task created with this executor as its first parameter
+   * @throws hal::resource_unavailable_try_again - if the frame pool was
+   * exhausted when the task was created
+   */
+  void spawn(async_task p_task);
+
+  /**
+   * @brief Give every task one chance to make progress
+   *
+   * @return true - tasks remain
+   */
+  bool run_once();
+
+  /// Run until every task has finished
+  void run();
+
+  /// Number of tasks spawned and not yet finished
+  std::size_t active() const;
+
+  /// Pool that task frames are allocated from
+  frame_pool& pool();
+
+private:
+  frame_pool m_pool;
+  std::array<async_task, frame_pool::max_frames> m_tasks{};
+};
+
+/**
+ * @brief Executor with frame storage for p_frame_count tasks built in
+ *
+ * @tparam p_frame_size - size of each frame slot in bytes
+ * @tparam p_frame_count - number of tasks that can exist at the same time
+ */
+template<std::size_t p_frame_size, std::size_t p_frame_count>
+class static_executor : public executor
+{
+public:
+  static_assert(p_frame_count <= frame_pool::max_frames);
+
+  static_executor()
+    : executor(m_memory, p_frame_size)
+  {
+  }
+
+private:
+  static constexpr auto slot_size =
+    (p_frame_size + alignof(std::max_align_t) - 1) /
+    alignof(std::max_align_t) * alignof(std::max_align_t);
+
+  alignas(std::max_align_t) std::array<hal::byte,
+                                       slot_size * p_frame_count> m_memory{};
+};
+
+/**
+ * @brief Awaitable block transfer built on microsd_card::start_read(),
+ * start_write() and poll()
+ *
+ * The task stays suspended while another task owns the card, while the card is
+ * busy and while a token has not arrived. Only one transfer per card runs at a
+ * time, later ones wait their turn.
+ */
+class block_transfer : public async_operation
+{
+public:
+  block_transfer(microsd_card& p_card,
+                 uint32_t p_first_block,
+                 std::span<hal::byte> p_data);
+  block_transfer(microsd_card& p_card,
+                 uint32_t p_first_block,
+                 std::span<hal::byte const> p_data);
+
+  bool await_ready() const noexcept
+  {
+    return false;
+  }
+  template<typename Promise>
+  void await_suspend(std::coroutine_handle<Promise> p_task) noexcept
+  {
+    p_task.promise().operation = this;
+  }
+  void await_resume() const;
+
+  bool poll() override;
+
+private:
+  microsd_card* m_card;
+  uint32_t m_first_block;
+  std::span<hal::byte> m_read{};
+  std::span<hal::byte const> m_write{};
+  microsd_card::io_status m_status = microsd_card::io_status::pending;
+  bool m_started = false;
+};
+
+/**
+ * @brief Read contiguous blocks without blocking the executor
+ *
+ * @param p_card - card to read from
+ * @param p_first_block - address of the first block to read
+ * @param p_data - destination, a non-zero multiple of `block_size` bytes
+ * @return block_transfer - awaitable, co_await it from an async_task
+ * @throws hal::argument_out_of_domain - if p_data is not block aligned
+ * @throws hal::io_error - from co_await, if the transfer failed
+ */
+[[nodiscard]] block_transfer async_read_blocks(microsd_card& p_card,
+                                               uint32_t p_first_block,
+                                               std::span<hal::byte> p_data);
+
+/**
+ * @brief Write contiguous blocks without blocking the executor
+ *
+ * @param p_card - card to write to
+ * @param p_first_block - address of the first block to write
+ * @param p_data - source, a non-zero multiple of `block_size` bytes
+ * @return block_transfer - awaitable, co_await it from an async_task
+ * @throws hal::argument_out_of_domain - if p_data is not block aligned
+ * @throws hal::io_error - from co_await, if the transfer failed
+ */
+[[nodiscard]] block_transfer async_write_blocks(
+  microsd_card& p_card,
+  uint32_t p_first_block,
+  std::span<hal::byte const> p_data);
+}  // namespace hal::sd
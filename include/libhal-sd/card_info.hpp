@@ -0,0 +1,404 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <span>
+
+#include <libhal/units.hpp>
+
+namespace hal::sd {
+/**
+ * @brief Extract a field from an SD register using the spec's bit numbering
+ *
+ * SD registers are transmitted most significant byte first and the spec
+ * numbers their bits from the end, so bit 0 is the least significant bit of
+ * the last byte.
+ *
+ * @param p_register - raw register contents as received from the card
+ * @param p_msb - most significant bit of the field (inclusive)
+ * @param p_lsb - least significant bit of the field (inclusive)
+ * @return constexpr uint32_t - the field, right aligned
+ */
+constexpr uint32_t extract_bits(std::span<hal::byte const> p_register,
+                                std::size_t p_msb,
+                                std::size_t p_lsb)
+{
+  auto const last_bit = p_register.size() * 8 - 1;
+  uint32_t field = 0;
+  for (auto bit = p_msb + 1; bit-- > p_lsb;) {
+    auto const position = last_bit - bit;
+    auto const value = (p_register[position / 8] >> (7 - position % 8)) & 1U;
+    field = (field << 1) | value;
+  }
+  return field;
+}
+
+/// Card-Specific Data register (CMD9)
+struct csd_register
+{
+  std::array<hal::byte, 16> raw{};
+
+  constexpr uint32_t bits(std::size_t p_msb, std::size_t p_lsb) const
+  {
+    return extract_bits(raw, p_msb, p_lsb);
+  }
+
+  /// CSD_STRUCTURE: 0 = SDSC (v1), 1 = SDHC/SDXC (v2), 2 = SDUC (v3)
+  constexpr uint32_t version() const
+  {
+    return bits(127, 126);
+  }
+
+  /// TRAN_SPEED: encoded maximum data transfer rate
+  constexpr hal::byte tran_speed() const
+  {
+    return static_cast<hal::byte>(bits(103, 96));
+  }
+
+  /// CCC: bitmask of supported command classes
+  constexpr uint32_t command_classes() const
+  {
+    return bits(95, 84);
+  }
+
+  /// READ_BL_LEN: log2 of the maximum read block length
+  constexpr uint32_t read_block_length() const
+  {
+    return bits(83, 80);
+  }
+
+  /// C_SIZE, whose width and position depend on the CSD version
+  constexpr uint32_t c_size() const
+  {
+    switch (version()) {
+      case 0:
+        return bits(73, 62);
+      case 1:
+        return bits(69, 48);
+      default:
+        return bits(75, 48);
+    }
+  }
+
+  /// C_SIZE_MULT: only present in version 1 CSDs
+  constexpr uint32_t c_size_mult() const
+  {
+    return bits(49, 47);
+  }
+
+  /// ERASE_BLK_EN: the card can erase single 512-byte blocks
+  constexpr bool erase_single_block() const
+  {
+    return bits(46, 46) != 0;
+  }
+
+  /// SECTOR_SIZE: erase sector size in write blocks, minus one
+  constexpr uint32_t erase_sector_size() const
+  {
+    return bits(45, 39);
+  }
+
+  /// Number of 512-byte sectors on the card
+  constexpr uint64_t sector_count() const
+  {
+    if (version() == 0) {
+      auto const block_count = static_cast<uint64_t>(c_size() + 1)
+                               << (c_size_mult() + 2);
+      return (block_count << read_block_length()) / 512;
+    }
+    // Version 2 and 3 report capacity in units of 512 KiB
+    return static_cast<uint64_t>(c_size() + 1) * 1024;
+  }
+
+  /// Maximum data transfer rate decoded from TRAN_SPEED
+  constexpr hal::hertz max_transfer_rate() const
+  {
+    // Multipliers are scaled by 10 to stay integral
+    constexpr std::array<uint32_t, 16> time_value{
+      0, 10, 12, 13, 15, 20, 25, 30, 35, 40, 45, 50, 55, 60, 70, 80
+    };
+    constexpr std::array<uint32_t, 4> rate_unit{
+      10'000, 100'000, 1'000'000, 10'000'000
+    };
+
+    auto const unit = static_cast<std::size_t>(tran_speed() & 0x07);
+    if (unit >= rate_unit.size()) {
+      return 0.0f;
+    }
+    auto const value = time_value[(tran_speed() >> 3) & 0x0F];
+    return static_cast<hal::hertz>(rate_unit[unit] * value);
+  }
+};
+
+/// Card Identification register (CMD10)
+struct cid_register
+{
+  std::array<hal::byte, 16> raw{};
+
+  constexpr uint32_t bits(std::size_t p_msb, std::size_t p_lsb) const
+  {
+    return extract_bits(raw, p_msb, p_lsb);
+  }
+
+  /// MID: manufacturer ID assigned by the SD-3C
+  constexpr hal::byte manufacturer_id() const
+  {
+    return static_cast<hal::byte>(bits(127, 120));
+  }
+
+  /// OID: two ASCII characters identifying the OEM
+  constexpr uint16_t oem_id() const
+  {
+    return static_cast<uint16_t>(bits(119, 104));
+  }
+
+  /// PNM: five ASCII characters of product name
+  constexpr std::array<char, 5> product_name() const
+  {
+    std::array<char, 5> name{};
+    for (std::size_t i = 0; i < name.size(); i++) {
+      name[i] = static_cast<char>(raw[3 + i]);
+    }
+    return name;
+  }
+
+  /// PRV: product revision as BCD major.minor
+  constexpr hal::byte revision() const
+  {
+    return static_cast<hal::byte>(bits(63, 56));
+  }
+
+  /// PSN: product serial number
+  constexpr uint32_t serial_number() const
+  {
+    return bits(55, 24);
+  }
+
+  /// MDT: manufacturing year
+  constexpr uint32_t manufacturing_year() const
+  {
+    return 2000 + bits(19, 12);
+  }
+
+  /// MDT: manufacturing month, 1 to 12
+  constexpr uint32_t manufacturing_month() const
+  {
+    return bits(11, 8);
+  }
+};
+
+/// Operation Conditions Register (CMD58)
+struct ocr_register
+{
+  uint32_t raw = 0;
+
+  /// Card power up status: the remaining bits are only valid once set
+  constexpr bool powered_up() const
+  {
+    return (raw & (1UL << 31)) != 0;
+  }
+
+  /// CCS: set for SDHC/SDXC/SDUC cards, which use block addressing
+  constexpr bool card_capacity_status() const
+  {
+    return (raw & (1UL << 30)) != 0;
+  }
+
+  /// Bitmask of supported VDD windows, bit 15 = 2.7-2.8V ... bit 23 = 3.5-3.6V
+  constexpr uint32_t voltage_window() const
+  {
+    return (raw >> 15) & 0x1FF;
+  }
+};
+
+/// SD Configuration Register (ACMD51)
+struct scr_register
+{
+  std::array<hal::byte, 8> raw{};
+
+  constexpr uint32_t bits(std::size_t p_msb, std::size_t p_lsb) const
+  {
+    return extract_bits(raw, p_msb, p_lsb);
+  }
+
+  /// SD_SPEC: physical layer spec version (0 = 1.0, 1 = 1.10, 2 = 2.00+)
+  constexpr uint32_t sd_spec() const
+  {
+    return bits(59, 56);
+  }
+
+  /// DATA_STAT_AFTER_ERASE: value of erased bits, 0 or 1
+  constexpr uint32_t data_after_erase() const
+  {
+    return bits(55, 55);
+  }
+
+  /// SD_SECURITY: security version supported
+  constexpr uint32_t security() const
+  {
+    return bits(54, 52);
+  }
+
+  /// CMD_SUPPORT: bit 0 = CMD20, 1 = CMD23, 2 = CMD48/49, 3 = CMD58/59
+  constexpr uint32_t command_support() const
+  {
+    return bits(35, 32);
+  }
+};
+
+/// SD Status (ACMD13): card features and performance characteristics
+struct sd_status_register
+{
+  std::array<hal::byte, 64> raw{};
+
+  constexpr uint32_t bits(std::size_t p_msb, std::size_t p_lsb) const
+  {
+    return extract_bits(raw, p_msb, p_lsb);
+  }
+
+  /// SPEED_CLASS: guaranteed sequential write speed in MB/s, 0 if unrated
+  constexpr uint32_t speed_class() const
+  {
+    constexpr std::array<uint32_t, 5> classes{ 0, 2, 4, 6, 10 };
+    auto const code = bits(447, 440);
+    return code < classes.size() ? classes[code] : 0;
+  }
+
+  /// Size in bytes of the allocation unit an AU_SIZE or UHS_AU_SIZE code
+  /// stands for, 0 if the code is 0
+  static constexpr uint32_t allocation_unit_bytes(uint32_t p_code)
+  {
+    // Codes 1 to 9 double from 16 KiB, codes 0xA to 0xF are listed in MiB
+    constexpr std::array<uint32_t, 6> large_sizes{ 8, 12, 16, 24, 32, 64 };
+    if (p_code == 0) {
+      return 0;
+    }
+    if (p_code <= 9) {
+      return (16U * 1024) << (p_code - 1);
+    }
+    return large_sizes[p_code - 10] * 1024 * 1024;
+  }
+
+  /// AU_SIZE: size of an allocation unit in bytes, 0 if not defined
+  constexpr uint32_t allocation_unit_size() const
+  {
+    return allocation_unit_bytes(bits(431, 428));
+  }
+
+  /// ERASE_SIZE: number of AUs erased within ERASE_TIMEOUT, 0 if not
+  /// supported
+  constexpr uint32_t erase_size() const
+  {
+    return bits(423, 408);
+  }
+
+  /// ERASE_TIMEOUT: seconds needed to erase ERASE_SIZE AUs, 0 if not
+  /// supported
+  constexpr uint32_t erase_timeout() const
+  {
+    return bits(407, 402);
+  }
+
+  /// ERASE_OFFSET: seconds added to every erase, 0 to 3
+  constexpr uint32_t erase_offset() const
+  {
+    return bits(401, 400);
+  }
+
+  /// UHS_SPEED_GRADE: minimum sequential write speed in MB/s, 0, 10 or 30
+  constexpr uint32_t uhs_speed_grade() const
+  {
+    return bits(399, 396) * 10;
+  }
+
+  /// UHS_AU_SIZE: allocation unit size in UHS modes in bytes, 0 if not
+  /// defined
+  constexpr uint32_t uhs_allocation_unit_size() const
+  {
+    // Codes below 7 (1 MiB) are not used
+    auto const code = bits(395, 392);
+    return code < 7 ? 0 : allocation_unit_bytes(code);
+  }
+
+  /// VIDEO_SPEED_CLASS: minimum sequential write speed in MB/s, 0 if unrated
+  constexpr uint32_t video_speed_class() const
+  {
+    return bits(391, 384);
+  }
+
+  /// APP_PERF_CLASS: application performance class, 0 if none, 1 = A1,
+  /// 2 = A2
+  constexpr uint32_t application_class() const
+  {
+    return bits(339, 336);
+  }
+
+  /// DISCARD_SUPPORT: CMD38 with the discard argument is supported
+  constexpr bool discard_support() const
+  {
+    return bits(313, 313) != 0;
+  }
+};
+
+/// Everything the driver learns about a card during init()
+struct card_info
+{
+  csd_register csd{};
+  cid_register cid{};
+  ocr_register ocr{};
+  scr_register scr{};
+  /// Only read from cards that follow SD 2.00 or later, zeroed otherwise
+  sd_status_register sd_status{};
+
+  /// Number of 512-byte sectors on the card
+  constexpr uint64_t sector_count() const
+  {
+    return csd.sector_count();
+  }
+
+  /// SDHC/SDXC/SDUC cards take block numbers, SDSC cards take byte offsets
+  constexpr bool block_addressing() const
+  {
+    return ocr.card_capacity_status();
+  }
+
+  /// Maximum data transfer rate reported by the card
+  constexpr hal::hertz max_transfer_rate() const
+  {
+    return csd.max_transfer_rate();
+  }
+
+  /// Erase sector size in 512-byte sectors, the card's natural erase unit
+  constexpr uint32_t erase_block_size() const
+  {
+    return csd.erase_sector_size() + 1;
+  }
+
+  /// Allocation unit size in 512-byte sectors, 0 if the card does not say.
+  /// Writes that stay within one AU avoid extra garbage collection.
+  constexpr uint32_t allocation_unit_sectors() const
+  {
+    return sd_status.allocation_unit_size() / 512;
+  }
+
+  /// Value read back from erased sectors, 0x00 or 0xFF
+  constexpr hal::byte erased_byte() const
+  {
+    return scr.data_after_erase() ? 0xFF : 0x00;
+  }
+};
+}  // namespace hal::sd
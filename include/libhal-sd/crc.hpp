@@ -0,0 +1,113 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <span>
+
+#include <libhal/units.hpp>
+
+namespace hal::sd {
+namespace detail {
+inline constexpr hal::byte crc7_polynomial = 0x09;
+
+/// CRC7 register values kept left aligned, so each byte is one lookup
+inline constexpr auto crc7_table = [] {
+  std::array<hal::byte, 256> table{};
+  for (uint32_t i = 0; i < 256; i++) {
+    auto crc = static_cast<hal::byte>(i);
+    for (int bit = 0; bit < 8; bit++) {
+      auto const shifted = static_cast<hal::byte>(crc << 1);
+      crc = (crc & 0x80) ? shifted ^ (crc7_polynomial << 1) : shifted;
+    }
+    table[i] = crc;
+  }
+  return table;
+}();
+
+inline constexpr uint16_t crc16_polynomial = 0x1021;
+
+/// Slicing-by-8 tables: table[k][i] is the CRC of byte i followed by k zeros
+inline constexpr auto crc16_tables = [] {
+  std::array<std::array<uint16_t, 256>, 8> tables{};
+  for (uint32_t i = 0; i < 256; i++) {
+    auto crc = static_cast<uint16_t>(i << 8);
+    for (int bit = 0; bit < 8; bit++) {
+      auto const shifted = static_cast<uint16_t>(crc << 1);
+      crc = (crc & 0x8000) ? shifted ^ crc16_polynomial : shifted;
+    }
+    tables[0][i] = crc;
+  }
+  for (std::size_t k = 1; k < tables.size(); k++) {
+    for (std::size_t i = 0; i < 256; i++) {
+      auto const previous = tables[k - 1][i];
+      tables[k][i] =
+        static_cast<uint16_t>((previous << 8) ^ tables[0][previous >> 8]);
+    }
+  }
+  return tables;
+}();
+}  // namespace detail
+
+/**
+ * @brief Compute the CRC7 (x^7 + x^3 + 1) used to protect command frames
+ *
+ * Constant arguments are folded at compile time. Runtime arguments, such as
+ * block addresses, take one table lookup per byte.
+ *
+ * @param p_data - bytes to protect, the first 5 bytes of a command frame
+ * @return constexpr hal::byte - 7-bit CRC, right aligned
+ */
+constexpr hal::byte crc7(std::span<hal::byte const> p_data)
+{
+  hal::byte crc = 0;
+  for (auto const data : p_data) {
+    crc = detail::crc7_table[crc ^ data];
+  }
+  return crc >> 1;
+}
+
+/**
+ * @brief Compute the CRC16-CCITT (x^16 + x^12 + x^5 + 1) used on data blocks
+ *
+ * Eight bytes are folded into the CRC per step using slicing-by-8 tables, so a
+ * 512-byte block costs 64 steps of 8 table lookups each.
+ *
+ * @param p_data - bytes to protect
+ * @param p_crc - running CRC when a block is split across several calls
+ * @return constexpr uint16_t - CRC of p_data appended to the running CRC
+ */
+constexpr uint16_t crc16(std::span<hal::byte const> p_data, uint16_t p_crc = 0)
+{
+  auto const& table = detail::crc16_tables;
+  auto crc = p_crc;
+
+  while (p_data.size() >= 8) {
+    auto const d = p_data.first<8>();
+    crc = static_cast<uint16_t>(
+      table[7][d[0] ^ (crc >> 8)] ^ table[6][d[1] ^ (crc & 0xFF)] ^
+      table[5][d[2]] ^ table[4][d[3]] ^ table[3][d[4]] ^ table[2][d[5]] ^
+      table[1][d[6]] ^ table[0][d[7]]);
+    p_data = p_data.subspan(8);
+  }
+
+  for (auto const data : p_data) {
+    crc = static_cast<uint16_t>((crc << 8) ^ table[0][(crc >> 8) ^ data]);
+  }
+
+  return crc;
+}
+}  // namespace hal::sd
@@ -14,10 +14,21 @@
 
 #pragma once
 
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <span>
+
 #include <libhal-util/output_pin.hpp>
 #include <libhal-util/spi.hpp>
 #include <libhal/output_pin.hpp>
 #include <libhal/spi.hpp>
+#include <libhal/steady_clock.hpp>
+#include <libhal/units.hpp>
+
+#include "card_info.hpp"
+#include "crc.hpp"
+#include "response.hpp"
 
 namespace hal::sd {
 class microsd_card
@@ -25,6 +36,17 @@ class microsd_card
 public:
   static constexpr hal::byte kCommandBase = 0x40;
   static constexpr hal::byte DUMMY_CRC = 0x95;
+  static constexpr hal::byte kStartToken = 0xFE;
+  static constexpr hal::byte kMultiWriteToken = 0xFC;
+  static constexpr hal::byte kStopTranToken = 0xFD;
+  static constexpr hal::byte kReady = 0x00;
+  static constexpr hal::byte kIdleState = 0x01;
+  static constexpr hal::byte kNoResponse = 0xFF;
+  static constexpr hal::byte kDataAccepted = 0x05;
+  static constexpr hal::byte kDataCrcError = 0x0B;
+  /// Most filler bytes a card may send between a command and its R1 (NCR)
+  static constexpr std::size_t kMaxResponseDelay = 8;
+  static constexpr std::size_t block_size = 512;
 
   enum Command
   {
@@ -34,19 +56,29 @@ public:
     CMD0 = kCommandBase | 0,    // CMD0: reset the sd card (force it to go
                                 // to the idle state)
     CMD1 = kCommandBase | 1,    // CMD1: starts an initiation of the card
+    CMD6 = kCommandBase | 6,    // CMD6: check or switch a card function,
+                                // such as High-Speed mode
     CMD8 = kCommandBase | 8,    // CMD8: request the sd card's support of
                                 // the provided host's voltage ranges
     CMD9 = kCommandBase | 9,    // CMD9: request the sd card's CSD
                                 // (card-specific data) register
+    CMD10 = kCommandBase | 10,  // CMD10: request the sd card's CID
+                                // (card identification) register
     CMD12 = kCommandBase | 12,  // CMD12: terminates a multi-block read or
                                 // write operation
-    CMD13 = kCommandBase | 13,  // CMD13: get status register
+    CMD13 = kCommandBase | 13,  // CMD13: get status register; as ACMD13
+                                // (must precede with CMD55) it returns
+                                // the 64-byte SD Status instead
     CMD16 = kCommandBase | 16,  // CMD16: change block length (only
                                 // effective in SDSC cards; SDHC/SDXC
                                 // cards are locked to 512-byte blocks)
     CMD17 = kCommandBase | 17,  // CMD17: read a single block of data
     CMD18 = kCommandBase | 18,  // CMD18: read many blocks of data until
                                 // a "CMD12" frame is sent
+    CMD23 = kCommandBase | 23,  // CMD23: application-specific command
+                                // SET_WR_BLK_ERASE_COUNT, number of blocks
+                                // to pre-erase before a CMD25 (must
+                                // precede with CMD55)
     CMD24 = kCommandBase | 24,  // CMD24: write a single block of data
     CMD25 = kCommandBase | 25,  // CMD25: write many blocks of data until
                                 // a "CMD12" frame is sent
@@ -61,26 +93,466 @@ public:
                                 // application-specific command
     CMD58 = kCommandBase | 58,  // CMD58: request data from the
                                 // operational conditions register
-    CMD41 = kCommandBase | 41   // CMD41: application-specific version of
+    CMD59 = kCommandBase | 59,  // CMD59: turn CRC checking of commands
+                                // and data blocks on or off
+    CMD41 = kCommandBase | 41,  // CMD41: application-specific version of
                                 // CMD1 (must precede with CMD55)
+    CMD51 = kCommandBase | 51   // CMD51: application-specific command
+                                // that requests the SCR (SD configuration)
+                                // register (must precede with CMD55)
+  };
+
+  struct settings
+  {
+    /// Fastest SPI clock the board and SPI peripheral can sustain. The card's
+    /// own limit from the CSD TRAN_SPEED field is applied on top of this.
+    hal::hertz max_clock_rate = 25'000'000.0f;
+    /// Switch the card into High-Speed mode (50 MHz) with CMD6 if it
+    /// supports it.
+    bool high_speed = false;
+    /// Enable CRC checking with CMD59. Commands carry a CRC7 and every data
+    /// block is protected by a CRC16 that is verified on the way in.
+    bool crc = false;
+    /// Number of times a block that fails its CRC is transferred again
+    /// before giving up.
+    int crc_retries = 3;
+    /// Return from writes as soon as the card accepts the data instead of
+    /// waiting for it to finish programming. The busy period is waited out at
+    /// the start of the next command or by wait_ready().
+    bool write_behind = false;
+    /// Maximum number of bytes a single call to poll() clocks, excluding the
+    /// command frames themselves.
+    std::size_t poll_budget = 64;
+    /// Longest time init() waits for the card to leave the idle state
+    hal::time_duration init_timeout = std::chrono::seconds(1);
+    /// Longest time to wait for a data block to start after a read command
+    hal::time_duration read_timeout = std::chrono::milliseconds(100);
+    /// Longest time a written block may keep the card busy
+    hal::time_duration write_timeout = std::chrono::milliseconds(500);
+    /// Longest time an erase may keep the card busy
+    hal::time_duration erase_timeout = std::chrono::seconds(30);
+    /// After each blocking write, ask the card with CMD13 whether it
+    /// programmed the data without error. The blocks are only read back and
+    /// compared when the status reports a problem. Writes wait for the card
+    /// to finish programming even with write_behind set.
+    bool verify_writes = false;
+  };
+
+  /// Progress of a transfer started with start_read() or start_write()
+  enum class io_status : hal::byte
+  {
+    pending,
+    done,
+    error,
+  };
+
+  static constexpr hal::hertz kHighSpeedClockRate = 50'000'000.0f;
+
+  /**
+   * @brief Build a command frame with its CRC7
+   *
+   * Frames for constant arguments are computed entirely at compile time.
+   * Runtime arguments, such as block addresses, cost one table lookup per
+   * byte for the CRC7.
+   *
+   * @param p_command - command index, including the start and transmission
+   * bits
+   * @param p_argument - 32-bit command argument
+   * @return constexpr std::array<hal::byte, 6> - frame ready to be sent
+   */
+  static constexpr std::array<hal::byte, 6> make_command(Command p_command,
+                                                         uint32_t p_argument)
+  {
+    std::array<hal::byte, 6> frame{
+      static_cast<hal::byte>(p_command),
+      static_cast<hal::byte>((p_argument >> 24) & 0xFF),
+      static_cast<hal::byte>((p_argument >> 16) & 0xFF),
+      static_cast<hal::byte>((p_argument >> 8) & 0xFF),
+      static_cast<hal::byte>(p_argument & 0xFF),
+      0x00,
+    };
+    // The CRC7 occupies the upper 7 bits of the last byte, followed by the
+    // end bit.
+    auto const crc = crc7(std::span<hal::byte const>(frame).first(5));
+    frame[5] = static_cast<hal::byte>(crc << 1 | 1);
+    return frame;
+  }
+
+  /**
+   * @brief Keeps the card selected for as long as the object lives
+   *
+   * Chip select is asserted when the outermost transaction begins and
+   * released when it ends. Every driver method runs inside one, so methods
+   * called while a transaction is held reuse it rather than toggling chip
+   * select. Holding one across several calls batches them into a single
+   * selection:
+   *
+   *     {
+   *       hal::sd::microsd_card::transaction batch(card);
+   *       card.write_block(10, header);
+   *       card.write_block(11, payload);
+   *     }
+   *
+   * Nothing else on the SPI bus may be used while a transaction is held.
+   */
+  class transaction
+  {
+  public:
+    explicit transaction(microsd_card& p_card);
+    transaction(transaction const&) = delete;
+    transaction& operator=(transaction const&) = delete;
+    ~transaction();
+
+  private:
+    microsd_card* m_card;
   };
 
   explicit microsd_card(hal::spi& p_spi, hal::output_pin& p_cs);
+  microsd_card(hal::spi& p_spi,
+               hal::output_pin& p_cs,
+               settings const& p_settings);
+
+  /**
+   * @brief Construct a driver whose waits are bounded by a steady clock
+   *
+   * Without a clock, the timeouts in settings are converted into a number of
+   * bytes clocked at the current SPI clock rate, which is only as accurate as
+   * the SPI driver is at keeping the bus busy.
+   *
+   * @param p_spi - spi bus the card is attached to
+   * @param p_cs - chip select of the card
+   * @param p_clock - clock used to enforce the timeouts in p_settings
+   * @param p_settings - driver settings
+   * @throws hal::timed_out - if the card does not respond in time
+   */
+  microsd_card(hal::spi& p_spi,
+               hal::output_pin& p_cs,
+               hal::steady_clock& p_clock,
+               settings const& p_settings);
+  /**
+   * @brief Bring the card out of reset and into data transfer mode
+   *
+   * @throws hal::device_or_resource_busy - if called while a transaction is
+   * held, as the power up clocks must be sent with the card deselected
+   * @throws hal::no_such_device - if no card answers CMD0
+   * @throws hal::operation_not_supported - if the card rejects the supply
+   * voltage
+   * @throws hal::timed_out - if the card does not leave the idle state within
+   * `settings::init_timeout`
+   * @throws hal::io_error - if the card fails to initialize
+   */
   void init();
   std::array<hal::byte, 512> read_block(uint32_t address,
                                         std::array<hal::byte, 512> data);
   void write_block(uint32_t address, std::array<hal::byte, 512> data);
 
+  /**
+   * @brief Read a single block directly into the caller's buffer
+   *
+   * @param p_address - address of the block to read
+   * @param p_data - destination for the block's contents
+   */
+  void read_block(uint32_t p_address, std::span<hal::byte, block_size> p_data);
+
+  /**
+   * @brief Write a single block directly from the caller's buffer
+   *
+   * @param p_address - address of the block to write
+   * @param p_data - contents of the block
+   * @throws hal::io_error - if the card rejects the block, or
+   * `settings::verify_writes` is set and the block did not program
+   */
+  void write_block(uint32_t p_address,
+                   std::span<hal::byte const, block_size> p_data);
+
+  /**
+   * @brief Read contiguous blocks using a single CMD18 transaction
+   *
+   * The card streams each block back-to-back after one command, so only one
+   * command and one CMD12 stop are paid for the whole range.
+   *
+   * @param p_first_block - address of the first block to read
+   * @param p_data - destination, must be a multiple of `block_size` bytes
+   * @throws hal::argument_out_of_domain - if p_data is not block aligned
+   */
+  void read_blocks(uint32_t p_first_block, std::span<hal::byte> p_data);
+
+  /**
+   * @brief Write contiguous blocks using a single CMD25 transaction
+   *
+   * ACMD23 is sent first with the block count so the card can pre-erase the
+   * whole range before the data arrives.
+   *
+   * @param p_first_block - address of the first block to write
+   * @param p_data - source, must be a multiple of `block_size` bytes
+   * @throws hal::argument_out_of_domain - if p_data is not block aligned
+   * @throws hal::io_error - if the card rejects a block, or
+   * `settings::verify_writes` is set and a block did not program
+   */
+  void write_blocks(uint32_t p_first_block, std::span<hal::byte const> p_data);
+
+  /**
+   * @brief Read contiguous blocks into several buffers with one CMD18
+   *
+   * The segments are filled in order as if they were one buffer, so block
+   * boundaries may fall anywhere inside a segment.
+   *
+   * @param p_first_block - address of the first block to read
+   * @param p_segments - destinations, their total size must be a multiple of
+   * `block_size` bytes
+   * @throws hal::argument_out_of_domain - if the total is not block aligned
+   */
+  void read_blocks_v(uint32_t p_first_block,
+                     std::span<std::span<hal::byte> const> p_segments);
+
+  /**
+   * @brief Write contiguous blocks from several buffers with one CMD25
+   *
+   * The segments are sent in order as if they were one buffer, so block
+   * boundaries may fall anywhere inside a segment.
+   *
+   * @param p_first_block - address of the first block to write
+   * @param p_segments - sources, their total size must be a multiple of
+   * `block_size` bytes
+   * @throws hal::argument_out_of_domain - if the total is not block aligned
+   * @throws hal::io_error - if the card rejects a block, or
+   * `settings::verify_writes` is set and a block did not program
+   */
+  void write_blocks_v(uint32_t p_first_block,
+                      std::span<std::span<hal::byte const> const> p_segments);
+
+  /**
+   * @brief Start a non-blocking read of contiguous blocks
+   *
+   * Chip select is taken by the first poll() and held until the transfer
+   * completes, so nothing else may use the SPI bus in between. On a shared
+   * spi_bus, poll() keeps returning io_status::pending until the bus is free.
+   *
+   * @param p_first_block - address of the first block to read
+   * @param p_data - destination, must stay valid until poll() stops returning
+   * io_status::pending. Must be a non-zero multiple of `block_size` bytes.
+   * @throws hal::argument_out_of_domain - if p_data is not block aligned
+   * @throws hal::device_or_resource_busy - if a transfer is already running
+   */
+  void start_read(uint32_t p_first_block, std::span<hal::byte> p_data);
+
+  /**
+   * @brief Start a non-blocking write of contiguous blocks
+   *
+   * @param p_first_block - address of the first block to write
+   * @param p_data - source, must stay valid until poll() stops returning
+   * io_status::pending. Must be a non-zero multiple of `block_size` bytes.
+   * @throws hal::argument_out_of_domain - if p_data is not block aligned
+   * @throws hal::device_or_resource_busy - if a transfer is already running
+   */
+  void start_write(uint32_t p_first_block, std::span<hal::byte const> p_data);
+
+  /**
+   * @brief Advance the transfer started by start_read() or start_write()
+   *
+   * Each call clocks at most `settings::poll_budget` bytes plus any command
+   * frames, so it returns quickly even while the card is busy.
+   *
+   * @return io_status - pending while the transfer is still running, then the
+   * outcome of the last transfer. Returns done if nothing was ever started.
+   */
+  io_status poll();
+
+  /**
+   * @brief Check whether a transfer started with start_read() or start_write()
+   * is still running
+   *
+   * @return true - poll() has not reported the transfer's outcome yet
+   */
+  bool transfer_pending() const;
+
+  /**
+   * @brief Wait for a write-behind write to finish programming
+   *
+   * Returns immediately if no write is outstanding. Call this before removing
+   * power or handing the card to something outside of this driver.
+   */
+  void wait_ready();
+
+  /**
+   * @brief Check whether a write-behind write may still be programming
+   *
+   * @return true - a write was accepted and its busy period not yet waited on
+   */
+  bool busy() const;
+
+  /**
+   * @brief Get the SPI clock rate chosen for the card by init()
+   *
+   * @return hal::hertz - current data transfer clock rate
+   */
+  hal::hertz clock_rate() const;
+
+  /**
+   * @brief Get the card registers parsed and cached during init()
+   *
+   * @return card_info const& - CSD, CID, OCR, SCR and SD Status of the card
+   */
+  card_info const& info() const;
+
+  /**
+   * @brief Read the card status with CMD13
+   *
+   * Errors from the last operation, such as a block that failed to program,
+   * are reported here and cleared by reading them.
+   *
+   * @return r2_response - R1 and the second status byte
+   * @throws hal::no_such_device - if the card does not respond
+   */
+  r2_response read_status();
+
+  /**
+   * @brief Read the SD Status with ACMD13
+   *
+   * The SD Status holds the allocation unit (AU) size, erase timing, speed
+   * class and application performance class. init() caches it in info() for
+   * cards that follow SD 2.00 or later.
+   *
+   * @return sd_status_register - the card's current SD Status
+   * @throws hal::operation_not_supported - if the card does not implement
+   * ACMD13
+   * @throws hal::io_error - if the status could not be read
+   */
+  sd_status_register read_sd_status();
+
+  /**
+   * @brief Erase or discard an inclusive range of blocks
+   *
+   * Erasing ahead of time lets the card's flash translation layer skip the
+   * erase when the blocks are later written. A discard only marks the blocks
+   * as unused and leaves the card to erase them when convenient, which is
+   * faster but leaves their contents undefined.
+   *
+   * @param p_first_block - first block to erase
+   * @param p_last_block - last block to erase (inclusive)
+   * @param p_discard - discard the range instead of erasing it (SD 5.0+,
+   * older cards perform a regular erase)
+   * @throws hal::argument_out_of_domain - if p_last_block < p_first_block
+   * @throws hal::io_error - if the card rejects the erase
+   */
+  void erase(uint32_t p_first_block,
+             uint32_t p_last_block,
+             bool p_discard = false);
+
   uint32_t read_c_size();
   float GetCapacity();
   std::array<hal::byte, 16> read_csd_register();
 
 private:
+  static constexpr std::size_t kLookaheadSize = 32;
+  static constexpr std::array<hal::byte, 64> kFiller = [] {
+    std::array<hal::byte, 64> filler{};
+    filler.fill(0xFF);
+    return filler;
+  }();
 
+  void select();
+  void deselect();
   void delay(int p_cycles);
+  bool switch_to_high_speed();
+  void read_register(Command p_command,
+                     std::span<hal::byte> p_data,
+                     bool p_application_command = false);
+  uint32_t card_address(uint32_t p_block) const;
+  r1_status send_command(Command p_command, uint32_t p_argument);
+  r1_status send_command(std::span<hal::byte const, 6> p_frame);
+  r1_status exchange_command(std::span<hal::byte const, 6> p_frame,
+                             std::size_t p_stuff_bytes);
+  void expect_ready(Command p_command, uint32_t p_argument);
+  void throw_if_error(r1_status p_r1, Command p_command);
+
+  /// steady_clock ticks with a clock, bytes clocked on the bus without one
+  using deadline = std::uint64_t;
+  deadline start_deadline(hal::time_duration p_timeout);
+  void check_deadline(deadline p_deadline);
+  hal::byte wait_while(hal::byte p_filler,
+                       std::size_t p_chunk,
+                       hal::time_duration p_timeout);
+  void wait_for_start_token(std::size_t p_payload_size);
+  void stop_transmission();
+  void abort_stream(bool p_writing);
+  template<typename Byte>
+  class segment_cursor;
+
+  bool receive_block(std::span<hal::byte> p_data);
+  bool receive_block(segment_cursor<hal::byte>& p_data, std::size_t p_size);
+  hal::byte transmit_block(hal::byte p_token,
+                           std::span<hal::byte const> p_data);
+  hal::byte transmit_block(hal::byte p_token,
+                           segment_cursor<hal::byte const>& p_data);
+  hal::byte read_data_response();
+  void wait_while_busy();
+  void finish_programming();
+  void verify_written(uint32_t p_first_block,
+                      std::span<std::span<hal::byte const> const> p_segments);
+  hal::byte skip_while_within(hal::byte p_filler,
+                              std::size_t p_chunk,
+                              std::size_t& p_budget);
+  void receive(std::span<hal::byte> p_data);
+  void transmit(std::span<hal::byte const> p_data);
+  void ensure_idle();
+  void start_transfer(uint32_t p_first_block, std::size_t p_size);
+  void io_step(std::size_t& p_budget);
+  void io_command();
+  void io_read_data(std::size_t& p_budget);
+  void io_read_crc();
+  void io_write_data(std::size_t& p_budget);
+  void io_write_response(std::size_t& p_budget);
+  void io_wait(hal::time_duration p_timeout);
+  void io_finish(io_status p_result);
+
+  enum class io_state : hal::byte
+  {
+    idle,
+    wait_ready,
+    command,
+    read_token,
+    read_data,
+    read_crc,
+    stop_read,
+    write_data,
+    write_crc,
+    write_response,
+    write_busy,
+    stop_write,
+  };
 
   hal::spi* m_spi;
   hal::output_pin* m_cs;
-  std::array<hal::byte, 1> m_wait{ 0xFF };
+  hal::steady_clock* m_clock = nullptr;
+  settings m_settings;
+  hal::hertz m_clock_rate = 0.0f;
+  card_info m_info{};
+  bool m_busy = false;
+  std::uint64_t m_bytes_clocked = 0;
+  // Number of transactions currently keeping the card selected
+  std::size_t m_select_depth = 0;
+  // Bytes clocked in while scanning for a token that belong to what follows it
+  std::array<hal::byte, kLookaheadSize> m_lookahead{};
+  std::size_t m_lookahead_begin = 0;
+  std::size_t m_lookahead_end = 0;
+  // Non-blocking transfer driven by poll()
+  io_state m_io_state = io_state::idle;
+  io_status m_io_result = io_status::done;
+  std::span<hal::byte> m_io_read{};
+  std::span<hal::byte const> m_io_write{};
+  uint32_t m_io_first_block = 0;
+  std::size_t m_io_size = 0;
+  std::size_t m_io_offset = 0;
+  std::size_t m_io_in_block = 0;
+  uint16_t m_io_crc = 0;
+  int m_io_retries = 0;
+  bool m_io_writing = false;
+  bool m_io_multiple = false;
+  // CMD18/CMD25 was accepted and the stream has not been stopped yet
+  bool m_io_streaming = false;
+  bool m_io_waiting = false;
+  bool m_io_selected = false;
+  deadline m_io_deadline = 0;
 };
 }  // namespace hal::sd
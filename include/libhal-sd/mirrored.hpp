@@ -0,0 +1,154 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+#include <libhal/units.hpp>
+
+#include "microsd.hpp"
+
+namespace hal::sd {
+/**
+ * @brief Block device that keeps the same blocks on two cards (RAID-1)
+ *
+ * Writes are started on both cards and polled together, so the second card
+ * receives its data while the first one programs and a write costs little
+ * more than writing one card. Reads of more than one block are split between
+ * the cards, and single block reads alternate between them, preferring a card
+ * that is not still programming a write-behind write.
+ *
+ * Each card's reads are timed by the number of poll() calls they take per
+ * block. A card that averages more than `slow_ratio` times the other card's
+ * cost, because it stalls on garbage collection or is simply a slower card,
+ * stops getting reads but is still written. Every `probe_interval` reads it
+ * serves one read again, so it gets its reads back once it has caught up.
+ *
+ * A card that fails or times out is dropped from the mirror and no longer
+ * read or written. The last card left is never dropped, its errors are
+ * reported instead. Once a dropped card has been replaced or resynchronized,
+ * restore() puts it back.
+ */
+class mirrored_device
+{
+public:
+  static constexpr std::size_t block_size = microsd_card::block_size;
+  /// Number of cards in the mirror
+  static constexpr std::size_t mirror_count = 2;
+  /// How many times the other card's read cost makes a card slow
+  static constexpr uint32_t slow_ratio = 4;
+  /// Reads between the ones given to a slow card to measure it again
+  static constexpr uint32_t probe_interval = 16;
+
+  /**
+   * @param p_primary - initialized card, read first when the cards are idle
+   * @param p_secondary - initialized card holding the same blocks
+   */
+  mirrored_device(microsd_card& p_primary, microsd_card& p_secondary);
+
+  mirrored_device(mirrored_device const&) = delete;
+  mirrored_device& operator=(mirrored_device const&) = delete;
+
+  /**
+   * @brief Read contiguous blocks from the cards still in the mirror
+   *
+   * A part that fails on one card is read again from the other.
+   *
+   * @param p_first_block - address of the first block to read
+   * @param p_data - destination, a non-zero multiple of `block_size` bytes
+   * @throws hal::argument_out_of_domain - if p_data is not block aligned or
+   * runs past block_count()
+   * @throws hal::device_or_resource_busy - if a card has a transfer running
+   * @throws hal::io_error - if no card could provide the data
+   */
+  void read_blocks(uint32_t p_first_block, std::span<hal::byte> p_data);
+
+  /**
+   * @brief Write contiguous blocks to every card still in the mirror
+   *
+   * @param p_first_block - address of the first block to write
+   * @param p_data - source, a non-zero multiple of `block_size` bytes
+   * @throws hal::argument_out_of_domain - if p_data is not block aligned or
+   * runs past block_count()
+   * @throws hal::device_or_resource_busy - if a card has a transfer running
+   * @throws hal::io_error - if no card accepted the data
+   */
+  void write_blocks(uint32_t p_first_block, std::span<hal::byte const> p_data);
+
+  /// Wait for write-behind writes on every card to finish programming
+  void wait_ready();
+
+  /**
+   * @brief Number of blocks the device holds, that of the smaller card
+   *
+   * @return uint32_t - capacity in blocks
+   */
+  uint32_t block_count() const;
+
+  /**
+   * @brief Check whether a card is still part of the mirror
+   *
+   * @param p_index - 0 for the primary card, 1 for the secondary
+   * @return true - the card is read and written
+   */
+  bool online(std::size_t p_index) const;
+
+  /// Number of cards still part of the mirror
+  std::size_t online_count() const;
+
+  /**
+   * @brief Check whether a card has been taken out of the read set for being
+   * slow
+   *
+   * @param p_index - 0 for the primary card, 1 for the secondary
+   * @return true - the card is written but only read to measure it again
+   */
+  bool slow(std::size_t p_index) const;
+
+  /**
+   * @brief Put a dropped card back into the mirror
+   *
+   * Only call this once the card holds the same blocks as the other one. The
+   * card's read cost is measured again from scratch.
+   *
+   * @param p_index - 0 for the primary card, 1 for the secondary
+   * @throws hal::argument_out_of_domain - if p_index is not a card
+   */
+  void restore(std::size_t p_index);
+
+private:
+  using poll_counts = std::array<uint32_t, mirror_count>;
+
+  void check_range(uint32_t p_first_block, std::size_t p_size);
+  bool readable(std::size_t p_index) const;
+  std::size_t pick_reader();
+  std::array<microsd_card::io_status, mirror_count> finish(
+    poll_counts& p_polls);
+  void record_read(std::size_t p_index, uint32_t p_polls, std::size_t p_size);
+  void drop(std::size_t p_index);
+
+  std::array<microsd_card*, mirror_count> m_cards;
+  std::array<bool, mirror_count> m_online{ true, true };
+  /// Average polls per block of each card's reads, in 1/16ths
+  std::array<uint32_t, mirror_count> m_read_cost{};
+  std::array<uint32_t, mirror_count> m_read_samples{};
+  uint32_t m_reads_since_probe = 0;
+  std::size_t m_next_read = 0;
+  uint32_t m_block_count;
+};
+}  // namespace hal::sd
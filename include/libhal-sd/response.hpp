@@ -0,0 +1,183 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cstdint>
+
+#include <libhal/units.hpp>
+
+#include "card_info.hpp"
+
+namespace hal::sd {
+/// R1: the first byte of every response in SPI mode
+struct r1_status
+{
+  /// 0xFF is what an idle MISO line reads as, so it stands for no response
+  hal::byte raw = 0xFF;
+
+  /// The card is in the idle state and running its initialization
+  constexpr bool in_idle_state() const
+  {
+    return (raw & 0x01) != 0;
+  }
+
+  /// An erase sequence was cleared before executing
+  constexpr bool erase_reset() const
+  {
+    return (raw & 0x02) != 0;
+  }
+
+  /// The command is not supported by the card or not legal in this state
+  constexpr bool illegal_command() const
+  {
+    return (raw & 0x04) != 0;
+  }
+
+  /// The CRC7 of the last command frame did not match
+  constexpr bool crc_error() const
+  {
+    return (raw & 0x08) != 0;
+  }
+
+  /// An error occurred in the sequence of erase commands
+  constexpr bool erase_sequence_error() const
+  {
+    return (raw & 0x10) != 0;
+  }
+
+  /// A misaligned address that did not match the block length was used
+  constexpr bool address_error() const
+  {
+    return (raw & 0x20) != 0;
+  }
+
+  /// The command's argument was outside the allowed range for this card
+  constexpr bool parameter_error() const
+  {
+    return (raw & 0x40) != 0;
+  }
+
+  /// The start bit is 0, so the byte is a response and not bus filler
+  constexpr bool responded() const
+  {
+    return (raw & 0x80) == 0;
+  }
+
+  /// Any of the error bits is set, or the card did not respond at all
+  constexpr bool has_error() const
+  {
+    return !responded() || (raw & 0x7E) != 0;
+  }
+
+  /// The card accepted the command and is out of the idle state
+  constexpr bool ready() const
+  {
+    return raw == 0x00;
+  }
+};
+
+/// R2: R1 followed by a second status byte, the response to CMD13
+struct r2_response
+{
+  r1_status r1{};
+  hal::byte raw = 0x00;
+
+  /// The card is locked by a password
+  constexpr bool card_is_locked() const
+  {
+    return (raw & 0x01) != 0;
+  }
+
+  /// Write protected blocks were skipped, or a lock/unlock command failed
+  constexpr bool wp_erase_skip() const
+  {
+    return (raw & 0x02) != 0;
+  }
+
+  /// A general or unknown error occurred during the operation
+  constexpr bool error() const
+  {
+    return (raw & 0x04) != 0;
+  }
+
+  /// The card's internal controller failed
+  constexpr bool cc_error() const
+  {
+    return (raw & 0x08) != 0;
+  }
+
+  /// Internal ECC was applied but failed to correct the data
+  constexpr bool card_ecc_failed() const
+  {
+    return (raw & 0x10) != 0;
+  }
+
+  /// A write protected block was written to
+  constexpr bool wp_violation() const
+  {
+    return (raw & 0x20) != 0;
+  }
+
+  /// An invalid selection of blocks was made for an erase
+  constexpr bool erase_param() const
+  {
+    return (raw & 0x40) != 0;
+  }
+
+  /// An argument was out of range, or the card failed to follow a command
+  constexpr bool out_of_range() const
+  {
+    return (raw & 0x80) != 0;
+  }
+
+  /// Either byte reports an error; a locked card alone is not one
+  constexpr bool has_error() const
+  {
+    return r1.has_error() || (raw & 0xFE) != 0;
+  }
+};
+
+/// R3: R1 followed by the OCR, the response to CMD58
+struct r3_response
+{
+  r1_status r1{};
+  ocr_register ocr{};
+};
+
+/// R7: R1 followed by the echoed interface conditions, the response to CMD8
+struct r7_response
+{
+  r1_status r1{};
+  uint32_t raw = 0;
+
+  /// Command version, 0 for cards following the 2.00 specification
+  constexpr hal::byte command_version() const
+  {
+    return static_cast<hal::byte>(raw >> 28);
+  }
+
+  /// Supply voltage range the card accepted, 0x1 = 2.7-3.6V
+  constexpr hal::byte voltage_accepted() const
+  {
+    return static_cast<hal::byte>((raw >> 8) & 0x0F);
+  }
+
+  /// Check pattern echoed back from the command argument
+  constexpr hal::byte check_pattern() const
+  {
+    return static_cast<hal::byte>(raw & 0xFF);
+  }
+};
+}  // namespace hal::sd
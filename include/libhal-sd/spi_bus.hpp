@@ -0,0 +1,136 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cstdint>
+#include <span>
+
+#include <libhal/output_pin.hpp>
+#include <libhal/spi.hpp>
+#include <libhal/units.hpp>
+
+namespace hal::sd {
+/**
+ * @brief Shares one SPI bus between several chip selects
+ *
+ * Every device on the bus gets its own spi_bus::device, which is handed to
+ * its driver in place of the real SPI bus and chip select:
+ *
+ *     hal::sd::spi_bus bus(spi);
+ *     hal::sd::spi_bus::device slot0(bus, cs0);
+ *     hal::sd::spi_bus::device slot1(bus, cs1);
+ *     hal::sd::microsd_card card0(slot0, slot0.chip_select());
+ *     hal::sd::microsd_card card1(slot1, slot1.chip_select());
+ *
+ * A device owns the bus from the moment its chip select is driven low until it
+ * is driven high again. The bus is only reconfigured when the owner's settings
+ * differ from the ones last applied, so devices sharing a clock rate never
+ * reconfigure it.
+ */
+class spi_bus
+{
+public:
+  /// One chip select on the bus, presented to its driver as an SPI bus
+  class device : public hal::spi
+  {
+  public:
+    /**
+     * @param p_bus - bus the device is attached to
+     * @param p_cs - chip select of the device, active low
+     */
+    device(spi_bus& p_bus, hal::output_pin& p_cs);
+
+    device(device const&) = delete;
+    device& operator=(device const&) = delete;
+
+    /**
+     * @brief Chip select that acquires the bus when driven low
+     *
+     * Driving it low throws hal::device_or_resource_busy while another device
+     * owns the bus, and leaves the real chip select untouched.
+     *
+     * @return hal::output_pin& - chip select to give to the driver
+     */
+    hal::output_pin& chip_select();
+
+    /**
+     * @brief Check whether this device currently owns the bus
+     *
+     * @return true - the device's chip select is low
+     */
+    bool selected() const;
+
+  private:
+    class select_pin : public hal::output_pin
+    {
+    public:
+      explicit select_pin(device& p_device);
+
+    private:
+      void driver_configure(hal::output_pin::settings const& p_settings)
+        override;
+      void driver_level(bool p_high) override;
+      bool driver_level() override;
+
+      device* m_device;
+    };
+
+    void driver_configure(hal::spi::settings const& p_settings) override;
+    void driver_transfer(std::span<hal::byte const> p_data_out,
+                         std::span<hal::byte> p_data_in,
+                         hal::byte p_filler) override;
+
+    friend class spi_bus;
+
+    spi_bus* m_bus;
+    hal::output_pin* m_cs;
+    hal::spi::settings m_settings{};
+    select_pin m_select;
+  };
+
+  /**
+   * @param p_spi - the bus to share, nothing else may use it directly
+   */
+  explicit spi_bus(hal::spi& p_spi);
+
+  spi_bus(spi_bus const&) = delete;
+  spi_bus& operator=(spi_bus const&) = delete;
+
+  /**
+   * @brief Check whether a device holds the bus
+   *
+   * @return true - a device's chip select is low
+   */
+  bool busy() const;
+
+  /**
+   * @brief Number of times the underlying bus was actually reconfigured
+   *
+   * @return std::uint32_t - configure() calls made on the real bus
+   */
+  std::uint32_t reconfigurations() const;
+
+private:
+  void acquire(device& p_device);
+  void release(device& p_device);
+  void apply(hal::spi::settings const& p_settings);
+
+  hal::spi* m_spi;
+  device* m_owner = nullptr;
+  hal::spi::settings m_active{};
+  bool m_configured = false;
+  std::uint32_t m_reconfigurations = 0;
+};
+}  // namespace hal::sd
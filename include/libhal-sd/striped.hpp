@@ -0,0 +1,112 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+#include <libhal/units.hpp>
+
+#include "microsd.hpp"
+
+namespace hal::sd {
+/**
+ * @brief Block device that stripes its blocks across several cards (RAID-0)
+ *
+ * Consecutive stripes of `stripe_blocks` blocks go to the cards in turn, so a
+ * long transfer keeps every card working at once. Transfers run through each
+ * card's start_read()/start_write() and poll(), which lets one card program
+ * a block while the next one is sent its data. Cards on separate SPI buses
+ * scale close to linearly; cards set up with `settings::write_behind` also
+ * overlap the programming that follows the last block of each stripe.
+ *
+ * There is no redundancy: losing any card loses the whole device.
+ */
+class striped_device
+{
+public:
+  static constexpr std::size_t block_size = microsd_card::block_size;
+  /// Maximum number of cards a device can stripe across
+  static constexpr std::size_t max_cards = 8;
+
+  /**
+   * @param p_cards - initialized cards to stripe across, in stripe order. The
+   * cards must outlive the device.
+   * @param p_stripe_blocks - number of consecutive blocks that go to one card
+   * before moving to the next. A multiple of the cards' erase or allocation
+   * unit size avoids splitting one program operation across two cards.
+   * @throws hal::argument_out_of_domain - if there are no cards, more than
+   * `max_cards`, or p_stripe_blocks is 0
+   */
+  striped_device(std::span<microsd_card* const> p_cards,
+                 uint32_t p_stripe_blocks);
+
+  striped_device(striped_device const&) = delete;
+  striped_device& operator=(striped_device const&) = delete;
+
+  /**
+   * @brief Read contiguous blocks from every card involved at once
+   *
+   * @param p_first_block - address of the first block to read
+   * @param p_data - destination, a non-zero multiple of `block_size` bytes
+   * @throws hal::argument_out_of_domain - if p_data is not block aligned or
+   * runs past block_count()
+   * @throws hal::device_or_resource_busy - if a card has a transfer running
+   * @throws hal::io_error - if any card fails its part of the transfer
+   */
+  void read_blocks(uint32_t p_first_block, std::span<hal::byte> p_data);
+
+  /**
+   * @brief Write contiguous blocks to every card involved at once
+   *
+   * @param p_first_block - address of the first block to write
+   * @param p_data - source, a non-zero multiple of `block_size` bytes
+   * @throws hal::argument_out_of_domain - if p_data is not block aligned or
+   * runs past block_count()
+   * @throws hal::device_or_resource_busy - if a card has a transfer running
+   * @throws hal::io_error - if any card fails its part of the transfer
+   */
+  void write_blocks(uint32_t p_first_block, std::span<hal::byte const> p_data);
+
+  /// Wait for write-behind writes on every card to finish programming
+  void wait_ready();
+
+  /**
+   * @brief Number of blocks the device holds
+   *
+   * Only whole stripes count, so each card contributes the same number of
+   * blocks, rounded down to a multiple of the stripe size.
+   *
+   * @return uint32_t - capacity in blocks
+   */
+  uint32_t block_count() const;
+
+  /// Number of consecutive blocks that go to one card
+  uint32_t stripe_blocks() const;
+
+private:
+  template<typename Start>
+  void run(uint32_t p_first_block, std::size_t p_size, Start p_start);
+  bool poll_all();
+  bool any_pending() const;
+
+  std::array<microsd_card*, max_cards> m_cards{};
+  std::size_t m_count;
+  uint32_t m_stripe_blocks;
+  uint32_t m_block_count = 0;
+};
+}  // namespace hal::sd
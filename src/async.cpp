@@ -0,0 +1,289 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "libhal-sd/async.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <utility>
+
+#include <libhal/error.hpp>
+
+namespace hal::sd {
+namespace {
+// Every slot starts with a pointer back to its pool, padded so the frame that
+// follows keeps the strictest alignment.
+constexpr std::size_t frame_alignment = alignof(std::max_align_t);
+constexpr std::size_t header_size = frame_alignment;
+static_assert(sizeof(frame_pool*) <= header_size);
+
+constexpr std::size_t align_up(std::size_t p_size)
+{
+  return (p_size + frame_alignment - 1) / frame_alignment * frame_alignment;
+}
+}  // namespace
+
+frame_pool::frame_pool(std::span<hal::byte> p_memory, std::size_t p_frame_size)
+  : m_memory(p_memory)
+  , m_frame_size(align_up(p_frame_size))
+  , m_capacity(std::min(p_memory.size() / m_frame_size, max_frames))
+{
+}
+
+void* frame_pool::allocate(std::size_t p_size) noexcept
+{
+  if (header_size + p_size > m_frame_size) {
+    return nullptr;
+  }
+
+  for (std::size_t slot = 0; slot < m_capacity; slot++) {
+    auto const mask = uint32_t{ 1 } << slot;
+    if ((m_used & mask) == 0) {
+      m_used |= mask;
+      auto* const header = m_memory.data() + slot * m_frame_size;
+      auto* const owner = this;
+      std::copy_n(reinterpret_cast<hal::byte const*>(&owner),
+                  sizeof(owner),
+                  header);
+      return header + header_size;
+    }
+  }
+
+  return nullptr;
+}
+
+void frame_pool::release(void* p_frame) noexcept
+{
+  auto* const header = static_cast<hal::byte*>(p_frame) - header_size;
+  frame_pool* owner = nullptr;
+  std::copy_n(header, sizeof(owner), reinterpret_cast<hal::byte*>(&owner));
+
+  auto const slot =
+    static_cast<std::size_t>(header - owner->m_memory.data()) /
+    owner->m_frame_size;
+  owner->m_used &= ~(uint32_t{ 1 } << slot);
+}
+
+std::size_t frame_pool::capacity() const
+{
+  return m_capacity;
+}
+
+std::size_t frame_pool::available() const
+{
+  return m_capacity - static_cast<std::size_t>(std::popcount(m_used));
+}
+
+async_task
+async_task::promise_base::get_return_object_on_allocation_failure() noexcept
+{
+  return async_task();
+}
+
+void async_task::promise_base::unhandled_exception()
+{
+  // The task is done at this point, the executor destroys it and passes the
+  // exception on to whoever is running it.
+  throw;
+}
+
+void* async_task::promise_base::allocate(std::size_t p_size,
+                                         executor& p_executor) noexcept
+{
+  return p_executor.pool().allocate(p_size);
+}
+
+void async_task::promise_base::release(void* p_frame) noexcept
+{
+  frame_pool::release(p_frame);
+}
+
+async_task::async_task(std::coroutine_handle<> p_handle,
+                       promise_base& p_promise)
+  : m_handle(p_handle)
+  , m_promise(&p_promise)
+{
+}
+
+async_task::async_task(async_task&& p_other) noexcept
+  : m_handle(std::exchange(p_other.m_handle, nullptr))
+  , m_promise(std::exchange(p_other.m_promise, nullptr))
+{
+}
+
+async_task& async_task::operator=(async_task&& p_other) noexcept
+{
+  if (this != &p_other) {
+    if (m_handle) {
+      m_handle.destroy();
+    }
+    m_handle = std::exchange(p_other.m_handle, nullptr);
+    m_promise = std::exchange(p_other.m_promise, nullptr);
+  }
+  return *this;
+}
+
+async_task::~async_task()
+{
+  if (m_handle) {
+    m_handle.destroy();
+  }
+}
+
+executor::executor(std::span<hal::byte> p_frame_memory,
+                   std::size_t p_frame_size)
+  : m_pool(p_frame_memory, p_frame_size)
+{
+}
+
+executor::~executor() = default;
+
+void executor::spawn(async_task p_task)
+{
+  if (!p_task.m_handle) {
+    hal::safe_throw(hal::resource_unavailable_try_again(this));
+  }
+
+  auto const free_slot = std::ranges::find_if(
+    m_tasks, [](async_task const& p_slot) { return !p_slot.m_handle; });
+  if (free_slot == m_tasks.end()) {
+    hal::safe_throw(hal::resource_unavailable_try_again(this));
+  }
+
+  *free_slot = std::move(p_task);
+}
+
+bool executor::run_once()
+{
+  for (auto& task : m_tasks) {
+    if (!task.m_handle) {
+      continue;
+    }
+
+    auto& promise = *task.m_promise;
+    if (promise.operation && !promise.operation->poll()) {
+      continue;
+    }
+    promise.operation = nullptr;
+
+    try {
+      task.m_handle.resume();
+    } catch (...) {
+      task = async_task();
+      throw;
+    }
+
+    if (task.m_handle.done()) {
+      task = async_task();
+    }
+  }
+
+  return active() > 0;
+}
+
+void executor::run()
+{
+  while (run_once()) {
+    continue;
+  }
+}
+
+std::size_t executor::active() const
+{
+  return static_cast<std::size_t>(
+    std::ranges::count_if(m_tasks, [](async_task const& p_task) {
+      return static_cast<bool>(p_task.m_handle);
+    }));
+}
+
+frame_pool& executor::pool()
+{
+  return m_pool;
+}
+
+block_transfer::block_transfer(microsd_card& p_card,
+                               uint32_t p_first_block,
+                               std::span<hal::byte> p_data)
+  : m_card(&p_card)
+  , m_first_block(p_first_block)
+  , m_read(p_data)
+{
+}
+
+block_transfer::block_transfer(microsd_card& p_card,
+                               uint32_t p_first_block,
+                               std::span<hal::byte const> p_data)
+  : m_card(&p_card)
+  , m_first_block(p_first_block)
+  , m_write(p_data)
+{
+}
+
+bool block_transfer::poll()
+{
+  if (!m_started) {
+    // Another task's transfer has the card, wait for it to finish
+    if (m_card->transfer_pending()) {
+      return false;
+    }
+
+    m_started = true;
+    try {
+      if (m_write.empty()) {
+        m_card->start_read(m_first_block, m_read);
+      } else {
+        m_card->start_write(m_first_block, m_write);
+      }
+    } catch (hal::exception const&) {
+      m_status = microsd_card::io_status::error;
+      return true;
+    }
+  }
+
+  m_status = m_card->poll();
+  return m_status != microsd_card::io_status::pending;
+}
+
+void block_transfer::await_resume() const
+{
+  if (m_status != microsd_card::io_status::done) {
+    hal::safe_throw(hal::io_error(m_card));
+  }
+}
+
+namespace {
+void check_block_aligned(microsd_card& p_card, std::size_t p_size)
+{
+  if (p_size == 0 || p_size % microsd_card::block_size != 0) {
+    hal::safe_throw(hal::argument_out_of_domain(&p_card));
+  }
+}
+}  // namespace
+
+block_transfer async_read_blocks(microsd_card& p_card,
+                                 uint32_t p_first_block,
+                                 std::span<hal::byte> p_data)
+{
+  check_block_aligned(p_card, p_data.size());
+  return { p_card, p_first_block, p_data };
+}
+
+block_transfer async_write_blocks(microsd_card& p_card,
+                                  uint32_t p_first_block,
+                                  std::span<hal::byte const> p_data)
+{
+  check_block_aligned(p_card, p_data.size());
+  return { p_card, p_first_block, p_data };
+}
+}  // namespace hal::sd
@@ -14,87 +14,663 @@
 
 #include "libhal-sd/microsd.hpp"
 
-namespace hal::sd {
+#include <algorithm>
+
+#include <libhal/error.hpp>
+
+#include "libhal-sd/crc.hpp"
 
+namespace hal::sd {
 microsd_card::microsd_card(hal::spi& p_spi, hal::output_pin& p_cs)
+  : microsd_card(p_spi, p_cs, settings{})
+{
+}
+
+microsd_card::microsd_card(hal::spi& p_spi,
+                           hal::output_pin& p_cs,
+                           settings const& p_settings)
   : m_spi(&p_spi)
   , m_cs(&p_cs)
+  , m_settings(p_settings)
 {
   init();
 }
 
+microsd_card::microsd_card(hal::spi& p_spi,
+                           hal::output_pin& p_cs,
+                           hal::steady_clock& p_clock,
+                           settings const& p_settings)
+  : m_spi(&p_spi)
+  , m_cs(&p_cs)
+  , m_clock(&p_clock)
+  , m_settings(p_settings)
+{
+  init();
+}
+
+microsd_card::transaction::transaction(microsd_card& p_card)
+  : m_card(&p_card)
+{
+  m_card->select();
+}
+
+microsd_card::transaction::~transaction()
+{
+  m_card->deselect();
+}
+
+void microsd_card::select()
+{
+  // Only counted once chip select is low, a shared bus may refuse it
+  if (m_select_depth == 0) {
+    m_cs->level(false);
+  }
+  m_select_depth++;
+}
+
+void microsd_card::deselect()
+{
+  if (--m_select_depth == 0) {
+    m_cs->level(true);
+  }
+}
+
 void microsd_card::init()
 {
   using namespace hal::literals;
 
+  ensure_idle();
+
+  if (m_select_depth != 0) {
+    hal::safe_throw(hal::device_or_resource_busy(this));
+  }
+
   hal::spi::settings p_settings = hal::spi::settings{
     .clock_rate = 100.0_kHz,
   };
   m_spi->configure(p_settings);
+  m_clock_rate = p_settings.clock_rate;
 
-  // Step 4 to 6: Send CMD55 and ACMD41 in a loop until the card is ready.
-  std::array<hal::byte, 6> cmd0{ Command::CMD0, 0x00, 0x00, 0x00, 0x00, 0x95 };
-  // std::array<hal::byte, 6> cmd1{ Command::CMD1, 0x50, 0x00, 0x00, 0x00, 0x95 };
-  std::array<hal::byte, 6> cmd8{ Command::CMD8, 0x00, 0x00, 0x01, 0xAA, 0x87 };
-  std::array<hal::byte, 6> cmd55{
-    Command::CMD55, 0x00, 0x00, 0x00, 0x00, 0x65
-  };
-  std::array<hal::byte, 6> cmd58{
-    Command::CMD58, 0x00, 0x00, 0x00, 0x00, 0x00
-  };
-  std::array<hal::byte, 6> acmd41{
-    Command::CMD41, 0x40, 0x00, 0x00, 0x00, 0x77
-  };
+  // Fixed frames are generated at compile time, CRC7 included
+  static constexpr auto cmd0 = make_command(CMD0, 0);
+  // CMD8: 2.7-3.6V supply with check pattern 0xAA
+  static constexpr auto cmd8 = make_command(CMD8, 0x0000'01AA);
+  static constexpr auto cmd55 = make_command(CMD55, 0);
+  static constexpr auto cmd58 = make_command(CMD58, 0);
+  // ACMD41: HCS set, the host supports high capacity cards
+  static constexpr auto acmd41 = make_command(CMD41, 0x4000'0000);
+
+  // These are the only two frames whose CRC is checked before CMD59
+  static_assert(cmd0[5] == 0x95);
+  static_assert(cmd8[5] == 0x87);
 
   // Step 1: Power up initialization. Provide at least 74 clock cycles with CS
   // high.
-  delay(100);
-  // Step 2: Send CMD0 until a valid response is received.
-
-  m_cs->level(false);
-  hal::write(*m_spi, cmd0);
-  delay(10);
-  hal::write(*m_spi, cmd8);
-  delay(10);
-  hal::write(*m_spi, cmd58);
-  delay(10);
-  hal::write(*m_spi, cmd55);
+  m_cs->level(true);
   delay(10);
-  hal::write(*m_spi, acmd41);
 
-  std::array<hal::byte, 3> crc{};
-  hal::read(*m_spi, crc);
+  {
+    // Steps 2 to 7 run as one transaction, the card stays selected throughout
+    transaction selected(*this);
 
-  if (crc[0] == 0x00 && crc[1] == 0x00 && crc[2] == 0x00) {
-    hal::write(*m_spi, cmd58);
-    delay(10);
-  } else {
-    hal::write(*m_spi, cmd55);
-    delay(10);
-    hal::write(*m_spi, acmd41);
-    delay(10);
-  }
+    // Step 2: Send CMD0 until the card reports that it is in the idle state.
+    r1_status r1{};
+    for (int attempt = 0; attempt < 10; ++attempt) {
+      r1 = send_command(cmd0);
+      if (r1.in_idle_state() && !r1.has_error()) {
+        break;
+      }
+    }
+    if (!r1.in_idle_state() || r1.has_error()) {
+      hal::safe_throw(hal::no_such_device(CMD0, this));
+    }
 
-  hal::write(*m_spi, cmd58);
-  delay(10);
-  m_cs->level(true);
+    // Step 3: CMD8 is only understood by version 2 cards, which echo back the
+    // voltage range and check pattern in the trailing 4 bytes of R7. Version
+    // 1 cards reject it as an illegal command.
+    std::array<hal::byte, 4> trailing{};
+    r7_response r7{ .r1 = send_command(cmd8) };
+    if (!r7.r1.illegal_command()) {
+      throw_if_error(r7.r1, CMD8);
+      receive(trailing);
+      r7.raw = (static_cast<uint32_t>(trailing[0]) << 24) |
+               (static_cast<uint32_t>(trailing[1]) << 16) |
+               (static_cast<uint32_t>(trailing[2]) << 8) |
+               (static_cast<uint32_t>(trailing[3]));
+      if (r7.voltage_accepted() != 0x1 || r7.check_pattern() != 0xAA) {
+        hal::safe_throw(hal::operation_not_supported(this));
+      }
+    }
+
+    // Step 4 to 6: Send CMD55 and ACMD41 in a loop until the card is ready.
+    auto const until = start_deadline(m_settings.init_timeout);
+    while (true) {
+      // Without CMD55 the card would take ACMD41 as a standard command
+      throw_if_error(send_command(cmd55), CMD55);
+      r1 = send_command(acmd41);
+      throw_if_error(r1, CMD41);
+      if (!r1.in_idle_state()) {
+        break;
+      }
+      check_deadline(until);
+    }
+
+    // Step 7: Read the OCR to learn whether the card uses block or byte
+    // addressing. CCS is only valid once the power up status bit is set.
+    r3_response r3{ .r1 = send_command(cmd58) };
+    throw_if_error(r3.r1, CMD58);
+    receive(trailing);
+    r3.ocr.raw = (static_cast<uint32_t>(trailing[0]) << 24) |
+                 (static_cast<uint32_t>(trailing[1]) << 16) |
+                 (static_cast<uint32_t>(trailing[2]) << 8) |
+                 (static_cast<uint32_t>(trailing[3]));
+    if (!r3.ocr.powered_up()) {
+      hal::safe_throw(hal::io_error(this));
+    }
+    m_info.ocr = r3.ocr;
+
+    // Byte addressed (SDSC) cards may power up with a different block length
+    if (!m_info.block_addressing()) {
+      expect_ready(CMD16, block_size);
+    }
+
+    // With CRC checking on, every frame from here on must carry a valid CRC7
+    // and every data block a valid CRC16.
+    if (m_settings.crc && !send_command(CMD59, 1).ready()) {
+      hal::safe_throw(hal::operation_not_supported(this));
+    }
+  }
 
   p_settings = hal::spi::settings{
     .clock_rate = 400.0_kHz,
   };
   m_spi->configure(p_settings);
+  m_clock_rate = p_settings.clock_rate;
+
+  // Step 8: Cache the card's registers so geometry queries never need to go
+  // back to the card.
+  read_register(CMD9, m_info.csd.raw);
+  read_register(CMD10, m_info.cid.raw);
+  read_register(CMD51, m_info.scr.raw, true);
+  if (m_info.scr.sd_spec() >= 2) {
+    m_info.sd_status = read_sd_status();
+  }
+
+  // Step 9: Ramp the clock up to the fastest rate both the card and the bus
+  // can handle. CMD6 requires SD 1.10 and command class 10.
+  auto clock_rate = m_info.max_transfer_rate();
+  bool const supports_switch =
+    m_info.scr.sd_spec() >= 1 && (m_info.csd.command_classes() & (1 << 10));
+
+  if (m_settings.high_speed && supports_switch && switch_to_high_speed()) {
+    clock_rate = kHighSpeedClockRate;
+  }
 
+  clock_rate = std::min(clock_rate, m_settings.max_clock_rate);
+  if (clock_rate > p_settings.clock_rate) {
+    p_settings.clock_rate = clock_rate;
+    m_spi->configure(p_settings);
+    m_clock_rate = clock_rate;
+  }
 }
 
-void microsd_card::delay(int p_cycles)
+bool microsd_card::switch_to_high_speed()
 {
-  m_cs->level(false);
-  for (int i = 0; i < p_cycles; ++i) {
-    hal::write(*m_spi, m_wait);
+  // Mode 1 (switch) with function group 1 set to High-Speed and every other
+  // group left as is.
+  static constexpr uint32_t switch_high_speed = 0x80FF'FFF1;
+
+  std::array<hal::byte, 64> status{};
+
+  transaction selected(*this);
+  if (!send_command(CMD6, switch_high_speed).ready()) {
+    // Cards older than SD 1.10 reject CMD6 as an illegal command
+    return false;
   }
-  m_cs->level(true);
-  m_cs->level(false);
 
+  bool const valid = receive_block(status);
+
+  // The result of function group 1 is reported in bits [379:376]
+  return valid && (status[16] & 0x0F) == 0x01;
+}
+
+r1_status microsd_card::send_command(Command p_command, uint32_t p_argument)
+{
+  auto const frame = make_command(p_command, p_argument);
+  return send_command(frame);
+}
+
+r1_status microsd_card::send_command(std::span<hal::byte const, 6> p_frame)
+{
+  // A write-behind write may still be programming, which is only waited on
+  // now that the card is needed again.
+  if (m_busy) {
+    wait_while_busy();
+    m_busy = false;
+  }
+
+  return exchange_command(p_frame, 0);
+}
+
+r1_status microsd_card::exchange_command(std::span<hal::byte const, 6> p_frame,
+                                         std::size_t p_stuff_bytes)
+{
+  // The frame, any stuff bytes and the whole NCR window are clocked in a
+  // single full-duplex transfer: the spi sends filler once the frame runs out
+  // and R1 is picked out of what came back. A card may send up to NCR filler
+  // bytes first, so R1 can be as late as the byte after them.
+  static constexpr std::size_t window_size = kMaxResponseDelay + 1;
+  std::array<hal::byte, 6 + 1 + window_size> response;
+  auto const length = p_frame.size() + p_stuff_bytes + window_size;
+  auto const received = std::span(response).first(length);
+  m_spi->transfer(p_frame, received, 0xFF);
+  m_bytes_clocked += length;
+
+  // R1 always starts with a 0 bit, which also keeps a data byte still coming
+  // out of a stopped CMD18 from being mistaken for it.
+  auto const window = received.subspan(p_frame.size() + p_stuff_bytes);
+  auto const r1 = std::ranges::find_if(
+    window, [](hal::byte p_byte) { return (p_byte & 0x80) == 0; });
+
+  m_lookahead_begin = 0;
+  m_lookahead_end = 0;
+  if (r1 == window.end()) {
+    return r1_status{ .raw = kNoResponse };
+  }
+
+  // Bytes clocked in after R1 are the start of the rest of the response, such
+  // as the R3/R7 payload or a busy signal, so they are kept for receive().
+  static_assert(kLookaheadSize >= window_size - 1);
+  auto const rest = std::span(std::next(r1), window.end());
+  std::ranges::copy(rest, m_lookahead.begin());
+  m_lookahead_end = rest.size();
+
+  return r1_status{ .raw = *r1 };
+}
+
+void microsd_card::expect_ready(Command p_command, uint32_t p_argument)
+{
+  auto const r1 = send_command(p_command, p_argument);
+  throw_if_error(r1, p_command);
+  if (r1.in_idle_state()) {
+    // The card was reset, by a brown out for example, and needs init() again
+    hal::safe_throw(hal::io_error(this));
+  }
+}
+
+void microsd_card::throw_if_error(r1_status p_r1, Command p_command)
+{
+  if (!p_r1.responded()) {
+    hal::safe_throw(hal::no_such_device(p_command, this));
+  }
+  if (p_r1.illegal_command()) {
+    hal::safe_throw(hal::operation_not_supported(this));
+  }
+  if (p_r1.address_error() || p_r1.parameter_error()) {
+    hal::safe_throw(hal::argument_out_of_domain(this));
+  }
+  if (p_r1.has_error()) {
+    hal::safe_throw(hal::io_error(this));
+  }
+}
+
+microsd_card::deadline microsd_card::start_deadline(
+  hal::time_duration p_timeout)
+{
+  auto const seconds = std::chrono::duration<double>(p_timeout).count();
+  if (m_clock) {
+    auto const ticks = seconds * static_cast<double>(m_clock->frequency());
+    return m_clock->uptime() + static_cast<deadline>(ticks);
+  }
+  // Without a clock, time is measured in bytes clocked at the current rate
+  auto const bytes = seconds * static_cast<double>(m_clock_rate) / 8.0;
+  return m_bytes_clocked + static_cast<deadline>(bytes);
+}
+
+void microsd_card::check_deadline(deadline p_deadline)
+{
+  auto const now = m_clock ? m_clock->uptime() : m_bytes_clocked;
+  if (now >= p_deadline) {
+    hal::safe_throw(hal::timed_out(this));
+  }
+}
+
+hal::byte microsd_card::wait_while(hal::byte p_filler,
+                                   std::size_t p_chunk,
+                                   hal::time_duration p_timeout)
+{
+  auto const until = start_deadline(p_timeout);
+  while (true) {
+    // The deadline is checked after every chunk that is scanned
+    std::size_t budget = std::min(p_chunk, kLookaheadSize);
+    auto const found = skip_while_within(p_filler, p_chunk, budget);
+    if (found != p_filler) {
+      return found;
+    }
+    check_deadline(until);
+  }
+}
+
+void microsd_card::wait_for_start_token(std::size_t p_payload_size)
+{
+  // Everything clocked after the token belongs to the payload and its CRC16,
+  // so the scan never reads further ahead than that.
+  auto const token =
+    wait_while(0xFF, p_payload_size + 3, m_settings.read_timeout);
+
+  // Anything other than filler or the start token is a data error token
+  if (token != kStartToken) {
+    hal::safe_throw(hal::io_error(this));
+  }
+}
+
+/// Walks a list of buffer segments as if they were one contiguous buffer
+template<typename Byte>
+class microsd_card::segment_cursor
+{
+public:
+  explicit segment_cursor(std::span<std::span<Byte> const> p_segments)
+    : m_segments(p_segments)
+  {
+  }
+
+  /// Move to p_offset bytes from the start of the first segment
+  void seek(std::size_t p_offset)
+  {
+    m_index = 0;
+    m_offset = p_offset;
+    skip_exhausted();
+  }
+
+  /// Take the next run of up to p_limit bytes that is contiguous in memory
+  std::span<Byte> take(std::size_t p_limit)
+  {
+    if (m_index == m_segments.size()) {
+      return {};
+    }
+    auto const& segment = m_segments[m_index];
+    auto const length = std::min(p_limit, segment.size() - m_offset);
+    auto const piece = segment.subspan(m_offset, length);
+    m_offset += length;
+    skip_exhausted();
+    return piece;
+  }
+
+private:
+  void skip_exhausted()
+  {
+    while (m_index < m_segments.size() &&
+           m_offset >= m_segments[m_index].size()) {
+      m_offset -= m_segments[m_index].size();
+      m_index++;
+    }
+  }
+
+  std::span<std::span<Byte> const> m_segments;
+  std::size_t m_index = 0;
+  std::size_t m_offset = 0;
+};
+
+namespace {
+template<typename Byte>
+std::size_t total_size(std::span<std::span<Byte> const> p_segments)
+{
+  std::size_t total = 0;
+  for (auto const& segment : p_segments) {
+    total += segment.size();
+  }
+  return total;
+}
+}  // namespace
+
+bool microsd_card::receive_block(std::span<hal::byte> p_data)
+{
+  segment_cursor<hal::byte> data(std::span(&p_data, 1));
+  return receive_block(data, p_data.size());
+}
+
+bool microsd_card::receive_block(segment_cursor<hal::byte>& p_data,
+                                 std::size_t p_size)
+{
+  wait_for_start_token(p_size);
+
+  // The CRC16 is folded in piece by piece as the payload lands in place
+  uint16_t checksum = 0;
+  for (auto remaining = p_size; remaining > 0;) {
+    auto const piece = p_data.take(remaining);
+    if (piece.empty()) {
+      hal::safe_throw(hal::argument_out_of_domain(this));
+    }
+    receive(piece);
+    if (m_settings.crc) {
+      checksum = crc16(piece, checksum);
+    }
+    remaining -= piece.size();
+  }
+
+  std::array<hal::byte, 2> crc;
+  receive(crc);
+
+  if (!m_settings.crc) {
+    return true;
+  }
+  auto const expected = static_cast<uint16_t>(crc[0] << 8 | crc[1]);
+  return checksum == expected;
+}
+
+hal::byte microsd_card::transmit_block(hal::byte p_token,
+                                       std::span<hal::byte const> p_data)
+{
+  segment_cursor<hal::byte const> data(std::span(&p_data, 1));
+  return transmit_block(p_token, data);
+}
+
+hal::byte microsd_card::transmit_block(hal::byte p_token,
+                                       segment_cursor<hal::byte const>& p_data)
+{
+  // At least one byte of filler must be clocked before the start token
+  std::array<hal::byte, 2> start_token = { 0xFF, p_token };
+  transmit(start_token);
+
+  uint16_t checksum = 0;
+  for (auto remaining = block_size; remaining > 0;) {
+    auto const piece = p_data.take(remaining);
+    if (piece.empty()) {
+      hal::safe_throw(hal::argument_out_of_domain(this));
+    }
+    transmit(piece);
+    if (m_settings.crc) {
+      checksum = crc16(piece, checksum);
+    }
+    remaining -= piece.size();
+  }
+
+  std::array<hal::byte, 2> crc = { DUMMY_CRC, DUMMY_CRC };
+  if (m_settings.crc) {
+    crc = { static_cast<hal::byte>(checksum >> 8),
+            static_cast<hal::byte>(checksum & 0xFF) };
+  }
+  transmit(crc);
+
+  return read_data_response();
+}
+
+void microsd_card::stop_transmission()
+{
+  static constexpr auto stop_command = make_command(CMD12, 0);
+
+  // The byte clocked in directly after CMD12 is a stuff byte that may hold
+  // leftover data, so the response window only starts after it.
+  exchange_command(stop_command, 1);
+
+  // The card holds MISO low while it leaves the data transfer state
+  wait_while_busy();
+}
+
+void microsd_card::abort_stream(bool p_writing)
+{
+  // A stream that failed part way still has the card in its data state, and
+  // every later command would fail until it is stopped. The failure that got
+  // here is the one reported, so errors while stopping are dropped.
+  try {
+    if (p_writing) {
+      std::array<hal::byte, 2> stop_token = { 0xFF, kStopTranToken };
+      std::array<hal::byte, 1> skip;
+      // The stop token is only seen once the card is done with the last block
+      wait_while_busy();
+      transmit(stop_token);
+      receive(skip);
+      wait_while_busy();
+    } else {
+      stop_transmission();
+    }
+  } catch (hal::exception const&) {
+    // Nothing more can be done here; the next command will tell
+  }
+}
+
+hal::byte microsd_card::read_data_response()
+{
+  // Data response token: xxx0'sss1 where sss = 010 means data accepted. The
+  // busy bytes that follow it are kept for wait_while_busy().
+  auto const response =
+    wait_while(0xFF, kLookaheadSize, m_settings.write_timeout);
+  return response & 0x1F;
+}
+
+void microsd_card::wait_while_busy()
+{
+  wait_while(0x00, kLookaheadSize, m_settings.write_timeout);
+}
+
+void microsd_card::finish_programming()
+{
+  if (m_settings.write_behind) {
+    // Let the card program in the background; the next command waits on it
+    m_busy = true;
+    return;
+  }
+  // Hold the transaction until the card has finished programming
+  wait_while_busy();
+}
+
+void microsd_card::verify_written(
+  uint32_t p_first_block,
+  std::span<std::span<hal::byte const> const> p_segments)
+{
+  // A clean status is enough, it costs two bytes instead of every block
+  if (!read_status().has_error()) {
+    return;
+  }
+
+  // The status only says that something went wrong since it was last read,
+  // so compare what the card holds now against what was sent.
+  std::array<hal::byte, block_size> stored;
+  segment_cursor<hal::byte const> data(p_segments);
+  auto const block_count = total_size(p_segments) / block_size;
+  for (std::size_t i = 0; i < block_count; i++) {
+    read_block(static_cast<uint32_t>(p_first_block + i), std::span(stored));
+
+    std::span<hal::byte const> remaining(stored);
+    while (!remaining.empty()) {
+      auto const piece = data.take(remaining.size());
+      if (!std::ranges::equal(piece, remaining.first(piece.size()))) {
+        hal::safe_throw(hal::io_error(this));
+      }
+      remaining = remaining.subspan(piece.size());
+    }
+  }
+}
+
+void microsd_card::wait_ready()
+{
+  ensure_idle();
+
+  if (!m_busy) {
+    return;
+  }
+
+  transaction selected(*this);
+  wait_while_busy();
+  m_busy = false;
+}
+
+bool microsd_card::busy() const
+{
+  return m_busy;
+}
+
+hal::byte microsd_card::skip_while_within(hal::byte p_filler,
+                                          std::size_t p_chunk,
+                                          std::size_t& p_limit)
+{
+  p_chunk = std::min(p_chunk, kLookaheadSize);
+
+  while (p_limit > 0) {
+    if (m_lookahead_begin == m_lookahead_end) {
+      auto const length = std::min(p_chunk, p_limit);
+      hal::read(*m_spi, std::span(m_lookahead).first(length));
+      m_bytes_clocked += length;
+      m_lookahead_begin = 0;
+      m_lookahead_end = length;
+    }
+
+    auto const begin = m_lookahead.begin() + m_lookahead_begin;
+    auto const end = m_lookahead.begin() + m_lookahead_end;
+    auto const found = std::find_if(
+      begin, end, [p_filler](hal::byte p_byte) { return p_byte != p_filler; });
+
+    auto const scanned = static_cast<std::size_t>(found - begin);
+    p_limit -= std::min(p_limit, scanned + (found != end ? 1 : 0));
+
+    if (found != end) {
+      // Keep the bytes clocked in after the match for the next receive()
+      m_lookahead_begin += scanned + 1;
+      return *found;
+    }
+    m_lookahead_begin = m_lookahead_end;
+  }
+
+  return p_filler;
+}
+
+void microsd_card::receive(std::span<hal::byte> p_data)
+{
+  auto const buffered =
+    std::min(p_data.size(), m_lookahead_end - m_lookahead_begin);
+  std::copy_n(m_lookahead.begin() + m_lookahead_begin,
+              buffered,
+              p_data.begin());
+  m_lookahead_begin += buffered;
+
+  if (buffered < p_data.size()) {
+    hal::read(*m_spi, p_data.subspan(buffered));
+    m_bytes_clocked += p_data.size() - buffered;
+  }
+}
+
+void microsd_card::transmit(std::span<hal::byte const> p_data)
+{
+  // Anything still buffered was clocked in before this point and can no longer
+  // be part of a response.
+  m_lookahead_begin = 0;
+  m_lookahead_end = 0;
+  hal::write(*m_spi, p_data);
+  m_bytes_clocked += p_data.size();
+}
+
+void microsd_card::delay(int p_cycles)
+{
+  // Clock the filler out in as few transfers as possible. Chip select is left
+  // alone so callers decide whether the card sees these clocks.
+  std::span<hal::byte const> filler(kFiller);
+  while (p_cycles > 0) {
+    auto const length =
+      std::min(static_cast<std::size_t>(p_cycles), filler.size());
+    hal::write(*m_spi, filler.first(length));
+    m_bytes_clocked += length;
+    p_cycles -= static_cast<int>(length);
+  }
 }
 
 // Reading a block
@@ -102,118 +678,652 @@ std::array<hal::byte, 512> microsd_card::read_block(
   uint32_t address,
   std::array<hal::byte, 512> data)
 {
-  using namespace hal::literals;
-
-  // Prepare CMD17 command with the desired address
-  std::array<hal::byte, 6> read_command{
-    CMD17,
-    static_cast<hal::byte>((address >> 24) & 0xFF),
-    static_cast<hal::byte>((address >> 16) & 0xFF),
-    static_cast<hal::byte>((address >> 8) & 0xFF),
-    static_cast<hal::byte>(address & 0xFF),
-    DUMMY_CRC
-  };
-
-  delay(10);
-  m_cs->level(false);
+  read_block(address, std::span<hal::byte, block_size>(data));
+  return data;
+}
 
-  // Use the write_then_read function for the entire transaction
-  hal::write(*m_spi, read_command);
-  delay(10);
+void microsd_card::read_block(uint32_t p_address,
+                              std::span<hal::byte, block_size> p_data)
+{
+  ensure_idle();
 
-  // Read data into buffer until start token is found
-  std::array<hal::byte, 1> m_check;
-  do {
-    hal::read(*m_spi, m_check);
-  } while (m_check[0] != 0xFE);
+  transaction selected(*this);
+  for (int attempt = 0;; attempt++) {
+    // Send CMD17 with the desired address
+    expect_ready(CMD17, card_address(p_address));
 
-  hal::read(*m_spi, data);
-  m_cs->level(true);
-  return data;
+    // Read data into buffer once the start token is found
+    if (receive_block(p_data)) {
+      return;
+    }
+    if (attempt >= m_settings.crc_retries) {
+      hal::safe_throw(hal::io_error(this));
+    }
+  }
 }
 
 // Writing a block
 void microsd_card::write_block(uint32_t address,
                                std::array<hal::byte, 512> data)
 {
-  using namespace hal::literals;
+  write_block(address, std::span<hal::byte const, block_size>(data));
+}
 
-  std::array<hal::byte, 1> dummy_crc_arr = { DUMMY_CRC };
-  std::array<hal::byte, 6> write_command{
-    CMD24,
-    static_cast<hal::byte>((address >> 24) & 0xFF),
-    static_cast<hal::byte>((address >> 16) & 0xFF),
-    static_cast<hal::byte>((address >> 8) & 0xFF),
-    static_cast<hal::byte>(address & 0xFF),
-    DUMMY_CRC
-  };
+void microsd_card::write_block(uint32_t p_address,
+                               std::span<hal::byte const, block_size> p_data)
+{
+  ensure_idle();
 
-  std::array<hal::byte, 1> start_token = { 0xFE };
+  transaction selected(*this);
+  for (int attempt = 0;; attempt++) {
+    expect_ready(CMD24, card_address(p_address));
 
-  m_cs->level(false);
-  hal::write(*m_spi, write_command);
-  delay(10);
-  hal::write(*m_spi, start_token);
-  hal::write(*m_spi, data);
-  delay(10);
-  hal::write(*m_spi, dummy_crc_arr);
-  hal::write(*m_spi, dummy_crc_arr);
-  m_cs->level(true);
+    auto const response = transmit_block(kStartToken, p_data);
+    if (response == kDataAccepted) {
+      finish_programming();
+      if (m_settings.verify_writes) {
+        std::span<hal::byte const> const block = p_data;
+        verify_written(p_address, std::span(&block, 1));
+      }
+      return;
+    }
+
+    // Only a block corrupted on the wire is worth sending again
+    if (response != kDataCrcError || attempt >= m_settings.crc_retries) {
+      hal::safe_throw(hal::io_error(this));
+    }
+    // The card may signal busy after the rejected block as it does after an
+    // accepted one, and would miss a CMD24 sent before it is done.
+    wait_while_busy();
+  }
+}
+
+// Reading many contiguous blocks
+void microsd_card::read_blocks(uint32_t p_first_block,
+                               std::span<hal::byte> p_data)
+{
+  read_blocks_v(p_first_block, std::span(&p_data, 1));
+}
+
+void microsd_card::read_blocks_v(
+  uint32_t p_first_block,
+  std::span<std::span<hal::byte> const> p_segments)
+{
+  ensure_idle();
+
+  auto const size = total_size(p_segments);
+  if (size % block_size != 0) {
+    hal::safe_throw(hal::argument_out_of_domain(this));
+  }
+
+  segment_cursor<hal::byte> data(p_segments);
+  std::size_t offset = 0;
+  int retries = 0;
+
+  transaction selected(*this);
+  while (offset < size) {
+    auto const block = p_first_block + offset / block_size;
+
+    expect_ready(CMD18, card_address(block));
+
+    // Each block arrives as its own start token, payload and CRC16. A block
+    // that fails its CRC ends the transfer and is requested again.
+    data.seek(offset);
+    try {
+      while (offset < size && receive_block(data, block_size)) {
+        offset += block_size;
+      }
+    } catch (hal::exception const&) {
+      abort_stream(false);
+      throw;
+    }
+
+    stop_transmission();
+
+    if (offset < size && retries++ >= m_settings.crc_retries) {
+      hal::safe_throw(hal::io_error(this));
+    }
+  }
+}
+
+// Writing many contiguous blocks
+void microsd_card::write_blocks(uint32_t p_first_block,
+                                std::span<hal::byte const> p_data)
+{
+  write_blocks_v(p_first_block, std::span(&p_data, 1));
+}
+
+void microsd_card::write_blocks_v(
+  uint32_t p_first_block,
+  std::span<std::span<hal::byte const> const> p_segments)
+{
+  ensure_idle();
+
+  auto const size = total_size(p_segments);
+  if (size % block_size != 0) {
+    hal::safe_throw(hal::argument_out_of_domain(this));
+  }
+
+  std::array<hal::byte, 2> stop_token = { 0xFF, kStopTranToken };
+  segment_cursor<hal::byte const> data(p_segments);
+  std::size_t offset = 0;
+  int retries = 0;
+
+  transaction selected(*this);
+  while (offset < size) {
+    auto const block = p_first_block + offset / block_size;
+    auto const block_count =
+      static_cast<uint32_t>((size - offset) / block_size);
+
+    // ACMD23 is only a hint, so a card that rejects it can still be written.
+    // A refused CMD55 leaves it out, as a bare CMD23 is a different command.
+    if (send_command(CMD55, 0).ready()) {
+      send_command(CMD23, block_count & 0x7F'FFFF);
+    }
+    expect_ready(CMD25, card_address(block));
+
+    auto response = kDataAccepted;
+    data.seek(offset);
+    try {
+      while (offset < size) {
+        response = transmit_block(kMultiWriteToken, data);
+        // A rejected block is followed by busy as well, and the stop token is
+        // only seen once that is over.
+        wait_while_busy();
+        if (response != kDataAccepted) {
+          break;
+        }
+        offset += block_size;
+      }
+    } catch (hal::exception const&) {
+      abort_stream(true);
+      throw;
+    }
+
+    // The stop token also aborts the transfer after a rejected block
+    transmit(stop_token);
+    // One byte is clocked before the card starts signalling busy
+    std::array<hal::byte, 1> skip;
+    receive(skip);
+    if (response == kDataAccepted) {
+      finish_programming();
+    } else {
+      wait_while_busy();
+    }
+
+    if (response != kDataAccepted &&
+        (response != kDataCrcError || retries++ >= m_settings.crc_retries)) {
+      hal::safe_throw(hal::io_error(this));
+    }
+  }
+
+  if (m_settings.verify_writes) {
+    verify_written(p_first_block, p_segments);
+  }
+}
+
+void microsd_card::erase(uint32_t p_first_block,
+                         uint32_t p_last_block,
+                         bool p_discard)
+{
+  static constexpr uint32_t erase_argument = 0x0000'0000;
+  static constexpr uint32_t discard_argument = 0x0000'0001;
+
+  ensure_idle();
+
+  if (p_last_block < p_first_block) {
+    hal::safe_throw(hal::argument_out_of_domain(this));
+  }
+
+  transaction selected(*this);
+  expect_ready(CMD32, card_address(p_first_block));
+  expect_ready(CMD33, card_address(p_last_block));
+  expect_ready(CMD38, p_discard ? discard_argument : erase_argument);
+
+  // CMD38 responds with R1b, the card stays busy until the range is erased
+  wait_while(0x00, kLookaheadSize, m_settings.erase_timeout);
+}
+
+void microsd_card::ensure_idle()
+{
+  // Blocking calls would corrupt a transfer that is holding chip select
+  if (m_io_state != io_state::idle) {
+    hal::safe_throw(hal::device_or_resource_busy(this));
+  }
+}
+
+void microsd_card::start_read(uint32_t p_first_block,
+                              std::span<hal::byte> p_data)
+{
+  start_transfer(p_first_block, p_data.size());
+  m_io_read = p_data;
+  m_io_write = {};
+  m_io_writing = false;
+}
+
+void microsd_card::start_write(uint32_t p_first_block,
+                               std::span<hal::byte const> p_data)
+{
+  start_transfer(p_first_block, p_data.size());
+  m_io_read = {};
+  m_io_write = p_data;
+  m_io_writing = true;
+}
+
+void microsd_card::start_transfer(uint32_t p_first_block, std::size_t p_size)
+{
+  ensure_idle();
+
+  if (p_size == 0 || p_size % block_size != 0) {
+    hal::safe_throw(hal::argument_out_of_domain(this));
+  }
+
+  m_io_first_block = p_first_block;
+  m_io_size = p_size;
+  m_io_offset = 0;
+  m_io_in_block = 0;
+  m_io_retries = 0;
+  m_io_result = io_status::pending;
+  m_io_state = io_state::wait_ready;
+  m_io_selected = false;
+  m_io_streaming = false;
+}
+
+microsd_card::io_status microsd_card::poll()
+{
+  if (m_io_state == io_state::idle) {
+    return m_io_result;
+  }
+
+  if (!m_io_selected) {
+    // Held until io_finish(), across as many poll() calls as the transfer
+    // takes. A shared bus that is in use leaves the transfer waiting.
+    try {
+      select();
+    } catch (hal::device_or_resource_busy const&) {
+      return io_status::pending;
+    } catch (hal::exception const&) {
+      io_finish(io_status::error);
+      return m_io_result;
+    }
+    m_io_selected = true;
+  }
+
+  auto budget = m_settings.poll_budget;
+  try {
+    // States that cannot make progress without the card leave the budget at
+    // zero, so this loop is bounded by the budget and the command frames.
+    while (budget > 0 && m_io_state != io_state::idle) {
+      io_step(budget);
+    }
+  } catch (hal::exception const&) {
+    io_finish(io_status::error);
+  }
+
+  return m_io_state == io_state::idle ? m_io_result : io_status::pending;
+}
+
+bool microsd_card::transfer_pending() const
+{
+  return m_io_state != io_state::idle;
+}
+
+void microsd_card::io_step(std::size_t& p_budget)
+{
+  switch (m_io_state) {
+    case io_state::wait_ready:
+      // Wait out the R1b/programming busy left by the previous command
+      if (m_busy) {
+        if (skip_while_within(0x00, kLookaheadSize, p_budget) == 0x00) {
+          io_wait(m_settings.write_timeout);
+          return;
+        }
+        m_busy = false;
+        m_io_waiting = false;
+      }
+      if (m_io_offset < m_io_size) {
+        m_io_state = io_state::command;
+      } else {
+        io_finish(io_status::done);
+      }
+      return;
+    case io_state::command:
+      io_command();
+      return;
+    case io_state::read_token: {
+      auto const token = skip_while_within(0xFF, block_size + 3, p_budget);
+      if (token == 0xFF) {
+        io_wait(m_settings.read_timeout);
+        return;
+      }
+      m_io_waiting = false;
+      if (token != kStartToken) {
+        io_finish(io_status::error);
+        return;
+      }
+      m_io_in_block = 0;
+      m_io_crc = 0;
+      m_io_state = io_state::read_data;
+      return;
+    }
+    case io_state::read_data:
+      io_read_data(p_budget);
+      return;
+    case io_state::read_crc:
+      io_read_crc();
+      return;
+    case io_state::stop_read: {
+      static constexpr auto stop_command = make_command(CMD12, 0);
+      exchange_command(stop_command, 1);
+      m_io_streaming = false;
+      // CMD12 is an R1b command, the busy is waited out in wait_ready
+      m_busy = true;
+      m_io_state = io_state::wait_ready;
+      return;
+    }
+    case io_state::write_data:
+      io_write_data(p_budget);
+      return;
+    case io_state::write_crc: {
+      std::array<hal::byte, 2> crc = { DUMMY_CRC, DUMMY_CRC };
+      if (m_settings.crc) {
+        crc = { static_cast<hal::byte>(m_io_crc >> 8),
+                static_cast<hal::byte>(m_io_crc & 0xFF) };
+      }
+      transmit(crc);
+      m_io_state = io_state::write_response;
+      return;
+    }
+    case io_state::write_response:
+      io_write_response(p_budget);
+      return;
+    case io_state::write_busy:
+      if (skip_while_within(0x00, kLookaheadSize, p_budget) == 0x00) {
+        io_wait(m_settings.write_timeout);
+        return;
+      }
+      m_busy = false;
+      m_io_waiting = false;
+      m_io_in_block = 0;
+      m_io_state = m_io_offset < m_io_size ? io_state::write_data
+                                           : io_state::stop_write;
+      return;
+    case io_state::stop_write: {
+      // Only a rejected block gets here with the card still busy
+      if (m_busy) {
+        if (skip_while_within(0x00, kLookaheadSize, p_budget) == 0x00) {
+          io_wait(m_settings.write_timeout);
+          return;
+        }
+        m_busy = false;
+        m_io_waiting = false;
+      }
+      std::array<hal::byte, 2> stop_token = { 0xFF, kStopTranToken };
+      std::array<hal::byte, 1> skip;
+      transmit(stop_token);
+      receive(skip);
+      m_io_streaming = false;
+      m_busy = true;
+      if (m_settings.write_behind && m_io_offset == m_io_size) {
+        io_finish(io_status::done);
+      } else {
+        m_io_state = io_state::wait_ready;
+      }
+      return;
+    }
+    case io_state::idle:
+    default:
+      p_budget = 0;
+      return;
+  }
+}
+
+void microsd_card::io_command()
+{
+  auto const block = m_io_first_block + m_io_offset / block_size;
+  auto const remaining =
+    static_cast<uint32_t>((m_io_size - m_io_offset) / block_size);
+  m_io_multiple = remaining > 1;
+  m_io_in_block = 0;
+
+  Command command = m_io_multiple ? CMD18 : CMD17;
+  if (m_io_writing) {
+    command = m_io_multiple ? CMD25 : CMD24;
+    if (m_io_multiple && send_command(CMD55, 0).ready()) {
+      send_command(CMD23, remaining & 0x7F'FFFF);
+    }
+  }
+
+  if (!send_command(command, card_address(block)).ready()) {
+    io_finish(io_status::error);
+    return;
+  }
+
+  m_io_streaming = m_io_multiple;
+  m_io_state = m_io_writing ? io_state::write_data : io_state::read_token;
+}
+
+void microsd_card::io_read_data(std::size_t& p_budget)
+{
+  auto const length = std::min(p_budget, block_size - m_io_in_block);
+  auto const chunk = m_io_read.subspan(m_io_offset + m_io_in_block, length);
+
+  receive(chunk);
+  if (m_settings.crc) {
+    m_io_crc = crc16(chunk, m_io_crc);
+  }
+
+  p_budget -= length;
+  m_io_in_block += length;
+  if (m_io_in_block == block_size) {
+    m_io_state = io_state::read_crc;
+  }
+}
+
+void microsd_card::io_read_crc()
+{
+  std::array<hal::byte, 2> crc;
+  receive(crc);
+
+  auto const expected = static_cast<uint16_t>(crc[0] << 8 | crc[1]);
+  bool const valid = !m_settings.crc || m_io_crc == expected;
+
+  if (valid) {
+    m_io_offset += block_size;
+  } else if (m_io_retries++ >= m_settings.crc_retries) {
+    io_finish(io_status::error);
+    return;
+  }
+
+  if (!m_io_multiple) {
+    // wait_ready issues CMD17 again if the block has to be read again
+    m_io_state = io_state::wait_ready;
+  } else if (valid && m_io_offset < m_io_size) {
+    m_io_state = io_state::read_token;
+  } else {
+    // The stream is stopped once complete, or to request a bad block again
+    m_io_state = io_state::stop_read;
+  }
+}
+
+void microsd_card::io_write_data(std::size_t& p_budget)
+{
+  if (m_io_in_block == 0) {
+    // At least one byte of filler must be clocked before the start token
+    std::array<hal::byte, 2> start_token = {
+      0xFF, m_io_multiple ? kMultiWriteToken : kStartToken
+    };
+    transmit(start_token);
+    m_io_crc = 0;
+  }
+
+  auto const length = std::min(p_budget, block_size - m_io_in_block);
+  auto const chunk = m_io_write.subspan(m_io_offset + m_io_in_block, length);
+
+  transmit(chunk);
+  if (m_settings.crc) {
+    m_io_crc = crc16(chunk, m_io_crc);
+  }
+
+  p_budget -= length;
+  m_io_in_block += length;
+  if (m_io_in_block == block_size) {
+    m_io_state = io_state::write_crc;
+  }
+}
+
+void microsd_card::io_write_response(std::size_t& p_budget)
+{
+  auto const response = skip_while_within(0xFF, kLookaheadSize, p_budget);
+  if (response == 0xFF) {
+    io_wait(m_settings.write_timeout);
+    return;
+  }
+  m_io_waiting = false;
+
+  auto const status = static_cast<hal::byte>(response & 0x1F);
+  if (status == kDataAccepted) {
+    m_io_offset += block_size;
+    m_busy = true;
+    if (m_io_multiple) {
+      m_io_state = io_state::write_busy;
+    } else if (m_settings.write_behind) {
+      io_finish(io_status::done);
+    } else {
+      m_io_state = io_state::wait_ready;
+    }
+    return;
+  }
 
+  // Only a block corrupted on the wire is worth sending again
+  if (status != kDataCrcError || m_io_retries++ >= m_settings.crc_retries) {
+    io_finish(io_status::error);
+    return;
+  }
+
+  m_busy = true;
+  m_io_state = m_io_multiple ? io_state::stop_write : io_state::wait_ready;
+}
+
+void microsd_card::io_wait(hal::time_duration p_timeout)
+{
+  // The deadline starts when a state first finds nothing to do and is checked
+  // on every later poll() that still finds nothing.
+  if (!m_io_waiting) {
+    m_io_deadline = start_deadline(p_timeout);
+    m_io_waiting = true;
+    return;
+  }
+  check_deadline(m_io_deadline);
+}
+
+void microsd_card::io_finish(io_status p_result)
+{
+  // Leave the card ready for the next command after a failed stream
+  if (p_result == io_status::error && m_io_streaming && m_io_selected) {
+    // A rejected block leaves the card busy for longer than the lookahead, and
+    // a stop token sent before it is done would be lost
+    abort_stream(m_io_writing);
+  }
+
+  if (m_io_selected) {
+    deselect();
+    m_io_selected = false;
+  }
+  m_io_state = io_state::idle;
+  m_io_waiting = false;
+  m_io_streaming = false;
+  m_io_result = p_result;
+  m_io_read = {};
+  m_io_write = {};
+}
+
+hal::hertz microsd_card::clock_rate() const
+{
+  return m_clock_rate;
 }
 
 std::array<hal::byte, 16> microsd_card::read_csd_register()
 {
+  ensure_idle();
+
   std::array<hal::byte, 16> csd_register = {};  // Initialize with zeros
+  read_register(CMD9, csd_register);
+  return csd_register;
+}
 
-  // Prepare CMD9 command with appropriate arguments and CRC
-  std::array<hal::byte, 6> cmd9{
-    Command::CMD9,
-    0x00,  // Argument (usually zero for CMD9)
-    0x00,          0x00, 0x00,
-    0x95  // Placeholder CRC (replace with actual CRC if needed)
-  };
+void microsd_card::read_register(Command p_command,
+                                 std::span<hal::byte> p_data,
+                                 bool p_application_command)
+{
+  transaction selected(*this);
+  if (p_application_command) {
+    expect_ready(CMD55, 0);
+  }
 
-  // Send CMD9 to SD card
-  delay(1);
-  m_cs->level(false);
-  hal::write(*m_spi, cmd9);
-  delay(1);
+  expect_ready(p_command, 0);
 
-  // Read data into buffer until start token is found
-  std::array<hal::byte, 1> m_check;
-  do {
-    hal::read(*m_spi, m_check);
-  } while (m_check[0] != 0xFE);
+  // Registers are sent as a data block with a start token and CRC16
+  if (!receive_block(p_data)) {
+    hal::safe_throw(hal::io_error(this));
+  }
+}
 
-  hal::read(*m_spi, csd_register);
-  m_cs->level(true);
+card_info const& microsd_card::info() const
+{
+  return m_info;
+}
 
-  return csd_register;
+r2_response microsd_card::read_status()
+{
+  ensure_idle();
+  r2_response status{};
+  transaction selected(*this);
+  status.r1 = send_command(CMD13, 0);
+  if (!status.r1.responded()) {
+    hal::safe_throw(hal::no_such_device(CMD13, this));
+  }
+  std::array<hal::byte, 1> second_byte{};
+  receive(second_byte);
+  status.raw = second_byte[0];
+  return status;
 }
 
-uint32_t microsd_card::read_c_size()
+sd_status_register microsd_card::read_sd_status()
 {
-  auto csd_register = read_csd_register();
-  uint32_t c_size =
-    (static_cast<uint32_t>(csd_register[6]) << 24) |
-    (static_cast<uint32_t>(csd_register[7]) << 16) |
-    (static_cast<uint32_t>(csd_register[8]) << 8) |
-    (static_cast<uint32_t>(csd_register[9]));  // Added this line
+  ensure_idle();
+
+  sd_status_register sd_status{};
+  transaction selected(*this);
+  expect_ready(CMD55, 0);
+  expect_ready(CMD13, 0);
+
+  // ACMD13 answers with R2. Its second byte comes before the data block and
+  // reports errors left over from earlier commands, which the status read
+  // here does not depend on.
+  std::array<hal::byte, 1> card_status{};
+  receive(card_status);
+  if (!receive_block(sd_status.raw)) {
+    hal::safe_throw(hal::io_error(this));
+  }
 
-  c_size = c_size & 0x3FFFFF;  // Adjust this mask as necessary to fit your data
-  return c_size;
+  return sd_status;
 }
 
-float microsd_card::GetCapacity()
+uint32_t microsd_card::card_address(uint32_t p_block) const
 {
-  auto c_size = read_c_size();
+  return m_info.block_addressing() ? p_block : p_block * block_size;
+}
 
-  float capacity = static_cast<float>((c_size + 1) * 512);  // in KBytes
-  capacity /= 1024;                                         // Convert to MBytes
-  capacity /= 1024;                                         // Convert to GBytes
+uint32_t microsd_card::read_c_size()
+{
+  return m_info.csd.c_size();
+}
 
-  return capacity;  // This returns the capacity in GBytes
+float microsd_card::GetCapacity()
+{
+  auto const bytes = static_cast<float>(m_info.sector_count()) * block_size;
+  return bytes / (1024.0f * 1024.0f * 1024.0f);  // in GBytes
 }
 
 // ------------------------------- High Level Functions
@@ -0,0 +1,276 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "libhal-sd/mirrored.hpp"
+
+#include <algorithm>
+#include <limits>
+
+#include <libhal/error.hpp>
+
+namespace hal::sd {
+namespace {
+/// Reads each card needs before its cost is compared with the other card's
+constexpr uint32_t settle_reads = 4;
+}  // namespace
+
+mirrored_device::mirrored_device(microsd_card& p_primary,
+                                 microsd_card& p_secondary)
+  : m_cards{ &p_primary, &p_secondary }
+{
+  auto const smallest = std::min(p_primary.info().sector_count(),
+                                 p_secondary.info().sector_count());
+  m_block_count = static_cast<uint32_t>(
+    std::min<uint64_t>(smallest, std::numeric_limits<uint32_t>::max()));
+}
+
+void mirrored_device::read_blocks(uint32_t p_first_block,
+                                  std::span<hal::byte> p_data)
+{
+  check_range(p_first_block, p_data.size());
+
+  // Cards that are equally ready share the range, otherwise the one that can
+  // start right away reads all of it.
+  std::array<std::span<hal::byte>, mirror_count> parts{};
+  auto const first = pick_reader();
+  auto const second = (first + 1) % mirror_count;
+  auto const blocks = p_data.size() / block_size;
+  if (readable(first) && readable(second) && blocks >= 2 &&
+      m_cards[first]->busy() == m_cards[second]->busy()) {
+    auto const half = blocks / 2 * block_size;
+    parts[first] = p_data.first(half);
+    parts[second] = p_data.subspan(half);
+  } else {
+    parts[first] = p_data;
+  }
+
+  auto const part_block = [&](std::size_t p_index) {
+    auto const offset = static_cast<std::size_t>(parts[p_index].data() -
+                                                 p_data.data());
+    return static_cast<uint32_t>(p_first_block + offset / block_size);
+  };
+
+  for (std::size_t i = 0; i < mirror_count; i++) {
+    if (!parts[i].empty()) {
+      m_cards[i]->start_read(part_block(i), parts[i]);
+    }
+  }
+  poll_counts polls{};
+  auto const status = finish(polls);
+
+  for (std::size_t i = 0; i < mirror_count; i++) {
+    if (parts[i].empty()) {
+      continue;
+    }
+    if (status[i] != microsd_card::io_status::error) {
+      record_read(i, polls[i], parts[i].size());
+      continue;
+    }
+
+    auto const other = (i + 1) % mirror_count;
+    if (!m_online[other]) {
+      hal::safe_throw(hal::io_error(this));
+    }
+    drop(i);
+
+    try {
+      m_cards[other]->read_blocks(part_block(i), parts[i]);
+    } catch (hal::exception const&) {
+      hal::safe_throw(hal::io_error(this));
+    }
+  }
+}
+
+void mirrored_device::write_blocks(uint32_t p_first_block,
+                                   std::span<hal::byte const> p_data)
+{
+  check_range(p_first_block, p_data.size());
+
+  // Polling both transfers together lets one card receive its data while the
+  // other one is busy programming.
+  std::array<bool, mirror_count> started{};
+  for (std::size_t i = 0; i < mirror_count; i++) {
+    if (m_online[i]) {
+      m_cards[i]->start_write(p_first_block, p_data);
+      started[i] = true;
+    }
+  }
+  poll_counts polls{};
+  auto const status = finish(polls);
+
+  std::size_t written = 0;
+  for (std::size_t i = 0; i < mirror_count; i++) {
+    if (started[i] && status[i] == microsd_card::io_status::done) {
+      written++;
+    }
+  }
+  // With nothing written the fault may well not lie with the cards, so both
+  // are kept.
+  if (written == 0) {
+    hal::safe_throw(hal::io_error(this));
+  }
+
+  for (std::size_t i = 0; i < mirror_count; i++) {
+    if (started[i] && status[i] == microsd_card::io_status::error) {
+      drop(i);
+    }
+  }
+}
+
+void mirrored_device::check_range(uint32_t p_first_block, std::size_t p_size)
+{
+  auto const blocks = p_size / block_size;
+  if (p_size == 0 || p_size % block_size != 0 ||
+      p_first_block + uint64_t{ blocks } > m_block_count) {
+    hal::safe_throw(hal::argument_out_of_domain(this));
+  }
+
+  for (auto* card : m_cards) {
+    if (card->transfer_pending()) {
+      hal::safe_throw(hal::device_or_resource_busy(this));
+    }
+  }
+}
+
+bool mirrored_device::readable(std::size_t p_index) const
+{
+  return m_online[p_index] && !slow(p_index);
+}
+
+std::size_t mirrored_device::pick_reader()
+{
+  auto const first = m_next_read;
+  auto const second = (first + 1) % mirror_count;
+  m_next_read = second;
+
+  if (!m_online[first]) {
+    return second;
+  }
+  if (!m_online[second]) {
+    return first;
+  }
+
+  // A slow card only gets the occasional read that measures it again
+  if (slow(first) || slow(second)) {
+    auto const slow_card = slow(first) ? first : second;
+    if (++m_reads_since_probe < probe_interval) {
+      return (slow_card + 1) % mirror_count;
+    }
+    m_reads_since_probe = 0;
+    return slow_card;
+  }
+  // A card still programming a write-behind write would make the read wait
+  if (m_cards[first]->busy() && !m_cards[second]->busy()) {
+    return second;
+  }
+  return first;
+}
+
+std::array<microsd_card::io_status, mirrored_device::mirror_count>
+mirrored_device::finish(poll_counts& p_polls)
+{
+  std::array<microsd_card::io_status, mirror_count> status{};
+  status.fill(microsd_card::io_status::done);
+  p_polls.fill(0);
+
+  bool pending = true;
+  while (pending) {
+    pending = false;
+    for (std::size_t i = 0; i < mirror_count; i++) {
+      if (m_cards[i]->transfer_pending()) {
+        status[i] = m_cards[i]->poll();
+        p_polls[i]++;
+        pending |= status[i] == microsd_card::io_status::pending;
+      }
+    }
+  }
+
+  return status;
+}
+
+void mirrored_device::record_read(std::size_t p_index,
+                                  uint32_t p_polls,
+                                  std::size_t p_size)
+{
+  auto const blocks = p_size / block_size;
+  auto const cost = static_cast<uint32_t>(std::min<uint64_t>(
+    uint64_t{ p_polls } * 16 / blocks, std::numeric_limits<uint32_t>::max()));
+
+  // Recent reads weigh the most, so a card that stops stalling is soon
+  // trusted again.
+  auto& average = m_read_cost[p_index];
+  if (m_read_samples[p_index] == 0) {
+    average = cost;
+  } else {
+    average = average - average / 4 + cost / 4;
+  }
+  if (m_read_samples[p_index] < settle_reads) {
+    m_read_samples[p_index]++;
+  }
+}
+
+void mirrored_device::drop(std::size_t p_index)
+{
+  m_online[p_index] = false;
+}
+
+void mirrored_device::wait_ready()
+{
+  for (std::size_t i = 0; i < mirror_count; i++) {
+    if (m_online[i]) {
+      m_cards[i]->wait_ready();
+    }
+  }
+}
+
+uint32_t mirrored_device::block_count() const
+{
+  return m_block_count;
+}
+
+bool mirrored_device::online(std::size_t p_index) const
+{
+  return p_index < mirror_count && m_online[p_index];
+}
+
+std::size_t mirrored_device::online_count() const
+{
+  return static_cast<std::size_t>(std::ranges::count(m_online, true));
+}
+
+bool mirrored_device::slow(std::size_t p_index) const
+{
+  if (p_index >= mirror_count) {
+    return false;
+  }
+  auto const other = (p_index + 1) % mirror_count;
+  // With a single card left there is nothing faster to read from
+  if (!m_online[p_index] || !m_online[other] ||
+      m_read_samples[p_index] < settle_reads ||
+      m_read_samples[other] < settle_reads) {
+    return false;
+  }
+  return m_read_cost[p_index] > uint64_t{ m_read_cost[other] } * slow_ratio;
+}
+
+void mirrored_device::restore(std::size_t p_index)
+{
+  if (p_index >= mirror_count) {
+    hal::safe_throw(hal::argument_out_of_domain(this));
+  }
+  m_online[p_index] = true;
+  m_read_cost[p_index] = 0;
+  m_read_samples[p_index] = 0;
+}
+}  // namespace hal::sd
@@ -1,13 +1,17 @@
-#include "diskio.h"  // Include FatFS disk I/O interface
+#include "libhal-sd/ff.h"      // Obtains integer types
+#include "libhal-sd/diskio.h"  // Include FatFS disk I/O interface
 #include "libhal-sd/microsd.hpp"
 
+#include <libhal/error.hpp>
+
 using namespace hal::sd;
 
-extern microsd_card sd; // Assuming you've created a global instance of your microsd_card class somewhere
+// Card behind drive 0, point this at your microsd_card before mounting
+microsd_card* sd = nullptr;
 
 // Implement disk status function
 DSTATUS disk_status(BYTE pdrv) {
-    if (pdrv == 0) {
+    if (pdrv == 0 && sd != nullptr) {
         // Assuming pdrv 0 corresponds to the SD card
         // Implement status check logic or simply return 0 if the status can't be checked
         return 0; // 0 means OK, no errors
@@ -17,23 +21,30 @@ DSTATUS disk_status(BYTE pdrv) {
 
 // Implement disk initialization function
 DSTATUS disk_initialize(BYTE pdrv) {
-    if (pdrv == 0) {
+    if (pdrv == 0 && sd != nullptr) {
         // Initialize your SD card and return the status
-        auto result = sd.init();
-        return result == hal::success() ? 0 : STA_NOINIT;
+        try {
+            sd->init();
+        } catch (hal::exception const&) {
+            return STA_NOINIT;
+        }
+        return 0;
     }
     return STA_NOINIT;
 }
 
 // Implement disk read function
 DRESULT disk_read(BYTE pdrv, BYTE* buff, DWORD sector, UINT count) {
-    if (pdrv == 0) {
-        for (UINT i = 0; i < count; i++) {
-            auto result = sd.read_block(sector + i, buff);
-            if (!result) {
-                return RES_ERROR;
+    if (pdrv == 0 && sd != nullptr) {
+        // FatFs buffers are handed straight to the driver, no copies
+        try {
+            if (count == 1) {
+                sd->read_block(sector, std::span<hal::byte, microsd_card::block_size>(buff, microsd_card::block_size));
+            } else {
+                sd->read_blocks(sector, std::span<hal::byte>(buff, count * microsd_card::block_size));
             }
-            buff += 512; // Move to the next block
+        } catch (hal::exception const&) {
+            return RES_ERROR;
         }
         return RES_OK;
     }
@@ -42,12 +53,15 @@ DRESULT disk_read(BYTE pdrv, BYTE* buff, DWORD sector, UINT count) {
 
 // Implement disk write function
 DRESULT disk_write(BYTE pdrv, const BYTE* buff, DWORD sector, UINT count) {
-    if (pdrv == 0) {
-        for (UINT i = 0; i < count; i++) {
-            if (sd.write_block(sector + i, buff) != hal::success()) {
-                return RES_ERROR;
+    if (pdrv == 0 && sd != nullptr) {
+        try {
+            if (count == 1) {
+                sd->write_block(sector, std::span<hal::byte const, microsd_card::block_size>(buff, microsd_card::block_size));
+            } else {
+                sd->write_blocks(sector, std::span<hal::byte const>(buff, count * microsd_card::block_size));
             }
-            buff += 512; // Move to the next block
+        } catch (hal::exception const&) {
+            return RES_ERROR;
         }
         return RES_OK;
     }
@@ -56,20 +70,40 @@ DRESULT disk_write(BYTE pdrv, const BYTE* buff, DWORD sector, UINT count) {
 
 // Implement disk I/O control function
 DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void* buff) {
-    if (pdrv == 0) {
+    if (pdrv == 0 && sd != nullptr) {
         switch (cmd) {
             case CTRL_SYNC:
-                // Flush the cache if you have caching
+                // Make sure a write-behind write has reached the flash
+                try {
+                    sd->wait_ready();
+                } catch (hal::exception const&) {
+                    return RES_ERROR;
+                }
                 return RES_OK;
-            case GET_SECTOR_COUNT: // if needed
-                // *(DWORD*)buff = total sectors;
+            case GET_SECTOR_COUNT:
+                // Served from the registers cached by init()
+                *(LBA_t*)buff = static_cast<LBA_t>(sd->info().sector_count());
                 return RES_OK;
-            case GET_SECTOR_SIZE: // if needed
-                // *(WORD*)buff = sector size;
+            case GET_SECTOR_SIZE:
+                *(WORD*)buff = microsd_card::block_size;
                 return RES_OK;
-            case GET_BLOCK_SIZE: // if needed
-                // *(DWORD*)buff = block size;
+            case GET_BLOCK_SIZE: {
+                // f_mkfs aligns the data area to this, so prefer the AU size
+                // and fall back to the CSD erase sector on older cards
+                auto const au_sectors = sd->info().allocation_unit_sectors();
+                *(DWORD*)buff = au_sectors != 0 ? au_sectors : sd->info().erase_block_size();
                 return RES_OK;
+            }
+            case CTRL_TRIM: {
+                // Erase freed clusters now so later writes to them are fast
+                auto const* range = static_cast<LBA_t const*>(buff);
+                try {
+                    sd->erase(range[0], range[1]);
+                } catch (hal::exception const&) {
+                    return RES_ERROR;
+                }
+                return RES_OK;
+            }
             default:
                 return RES_PARERR;
         }
@@ -0,0 +1,139 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "libhal-sd/spi_bus.hpp"
+
+#include <libhal/error.hpp>
+
+namespace hal::sd {
+namespace {
+bool same_settings(hal::spi::settings const& p_lhs,
+                   hal::spi::settings const& p_rhs)
+{
+  return p_lhs.clock_rate == p_rhs.clock_rate &&
+         p_lhs.clock_idles_high == p_rhs.clock_idles_high &&
+         p_lhs.data_valid_on_trailing_edge == p_rhs.data_valid_on_trailing_edge;
+}
+}  // namespace
+
+spi_bus::spi_bus(hal::spi& p_spi)
+  : m_spi(&p_spi)
+{
+}
+
+bool spi_bus::busy() const
+{
+  return m_owner != nullptr;
+}
+
+std::uint32_t spi_bus::reconfigurations() const
+{
+  return m_reconfigurations;
+}
+
+void spi_bus::acquire(device& p_device)
+{
+  if (m_owner != nullptr && m_owner != &p_device) {
+    hal::safe_throw(hal::device_or_resource_busy(this));
+  }
+  apply(p_device.m_settings);
+  m_owner = &p_device;
+}
+
+void spi_bus::release(device& p_device)
+{
+  if (m_owner == &p_device) {
+    m_owner = nullptr;
+  }
+}
+
+void spi_bus::apply(hal::spi::settings const& p_settings)
+{
+  if (m_configured && same_settings(m_active, p_settings)) {
+    return;
+  }
+  m_spi->configure(p_settings);
+  m_active = p_settings;
+  m_configured = true;
+  m_reconfigurations++;
+}
+
+spi_bus::device::device(spi_bus& p_bus, hal::output_pin& p_cs)
+  : m_bus(&p_bus)
+  , m_cs(&p_cs)
+  , m_select(*this)
+{
+}
+
+hal::output_pin& spi_bus::device::chip_select()
+{
+  return m_select;
+}
+
+bool spi_bus::device::selected() const
+{
+  return m_bus->m_owner == this;
+}
+
+void spi_bus::device::driver_configure(hal::spi::settings const& p_settings)
+{
+  // Applied when the device next acquires the bus, or now if it holds it
+  m_settings = p_settings;
+  if (selected()) {
+    m_bus->apply(m_settings);
+  }
+}
+
+void spi_bus::device::driver_transfer(std::span<hal::byte const> p_data_out,
+                                      std::span<hal::byte> p_data_in,
+                                      hal::byte p_filler)
+{
+  // Clocks sent with chip select high, such as the power up clocks of an SD
+  // card, borrow the bus only for the duration of the transfer.
+  if (!selected()) {
+    if (m_bus->busy()) {
+      hal::safe_throw(hal::device_or_resource_busy(this));
+    }
+    m_bus->apply(m_settings);
+  }
+  m_bus->m_spi->transfer(p_data_out, p_data_in, p_filler);
+}
+
+spi_bus::device::select_pin::select_pin(device& p_device)
+  : m_device(&p_device)
+{
+}
+
+void spi_bus::device::select_pin::driver_configure(
+  hal::output_pin::settings const& p_settings)
+{
+  m_device->m_cs->configure(p_settings);
+}
+
+void spi_bus::device::select_pin::driver_level(bool p_high)
+{
+  if (p_high) {
+    m_device->m_cs->level(true);
+    m_device->m_bus->release(*m_device);
+    return;
+  }
+  m_device->m_bus->acquire(*m_device);
+  m_device->m_cs->level(false);
+}
+
+bool spi_bus::device::select_pin::driver_level()
+{
+  return m_device->m_cs->level();
+}
+}  // namespace hal::sd
@@ -0,0 +1,149 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "libhal-sd/striped.hpp"
+
+#include <algorithm>
+#include <limits>
+
+#include <libhal/error.hpp>
+
+namespace hal::sd {
+striped_device::striped_device(std::span<microsd_card* const> p_cards,
+                               uint32_t p_stripe_blocks)
+  : m_count(p_cards.size())
+  , m_stripe_blocks(p_stripe_blocks)
+{
+  if (p_cards.empty() || p_cards.size() > max_cards || p_stripe_blocks == 0) {
+    hal::safe_throw(hal::argument_out_of_domain(this));
+  }
+  std::ranges::copy(p_cards, m_cards.begin());
+
+  uint64_t smallest = std::numeric_limits<uint32_t>::max();
+  for (auto* card : p_cards) {
+    smallest = std::min(smallest, card->info().sector_count());
+  }
+  auto const stripes_per_card = smallest / m_stripe_blocks;
+  auto const total = stripes_per_card * m_stripe_blocks * m_count;
+  m_block_count = static_cast<uint32_t>(
+    std::min<uint64_t>(total, std::numeric_limits<uint32_t>::max()));
+}
+
+void striped_device::read_blocks(uint32_t p_first_block,
+                                 std::span<hal::byte> p_data)
+{
+  run(p_first_block,
+      p_data.size(),
+      [p_data](microsd_card& p_card,
+               uint32_t p_card_block,
+               std::size_t p_offset,
+               std::size_t p_length) {
+        p_card.start_read(p_card_block, p_data.subspan(p_offset, p_length));
+      });
+}
+
+void striped_device::write_blocks(uint32_t p_first_block,
+                                  std::span<hal::byte const> p_data)
+{
+  run(p_first_block,
+      p_data.size(),
+      [p_data](microsd_card& p_card,
+               uint32_t p_card_block,
+               std::size_t p_offset,
+               std::size_t p_length) {
+        p_card.start_write(p_card_block, p_data.subspan(p_offset, p_length));
+      });
+}
+
+template<typename Start>
+void striped_device::run(uint32_t p_first_block,
+                         std::size_t p_size,
+                         Start p_start)
+{
+  auto const block_total = p_size / block_size;
+  if (p_size == 0 || p_size % block_size != 0 ||
+      p_first_block + uint64_t{ block_total } > m_block_count) {
+    hal::safe_throw(hal::argument_out_of_domain(this));
+  }
+  if (any_pending()) {
+    hal::safe_throw(hal::device_or_resource_busy(this));
+  }
+
+  bool failed = false;
+  for (std::size_t offset = 0; offset < p_size;) {
+    auto const block = p_first_block + offset / block_size;
+    auto const stripe = block / m_stripe_blocks;
+    auto const within = block % m_stripe_blocks;
+    auto& card = *m_cards[stripe % m_count];
+    auto const card_block = static_cast<uint32_t>(
+      stripe / m_count * m_stripe_blocks + within);
+    auto const length =
+      std::min<std::size_t>((m_stripe_blocks - within) * block_size,
+                            p_size - offset);
+
+    // Keep the other cards moving while this one finishes its last stripe
+    while (card.transfer_pending()) {
+      failed |= poll_all();
+    }
+    p_start(card, card_block, offset, length);
+    offset += length;
+  }
+
+  // Every card is drained before reporting a failure, so none of them is left
+  // holding its chip select.
+  while (any_pending()) {
+    failed |= poll_all();
+  }
+
+  if (failed) {
+    hal::safe_throw(hal::io_error(this));
+  }
+}
+
+bool striped_device::poll_all()
+{
+  bool failed = false;
+  for (auto* card : std::span(m_cards).first(m_count)) {
+    if (card->transfer_pending() &&
+        card->poll() == microsd_card::io_status::error) {
+      failed = true;
+    }
+  }
+  return failed;
+}
+
+bool striped_device::any_pending() const
+{
+  return std::ranges::any_of(
+    std::span(m_cards).first(m_count),
+    [](microsd_card const* p_card) { return p_card->transfer_pending(); });
+}
+
+void striped_device::wait_ready()
+{
+  for (auto* card : std::span(m_cards).first(m_count)) {
+    card->wait_ready();
+  }
+}
+
+uint32_t striped_device::block_count() const
+{
+  return m_block_count;
+}
+
+uint32_t striped_device::stripe_blocks() const
+{
+  return m_stripe_blocks;
+}
+}  // namespace hal::sd
@@ -0,0 +1,146 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <libhal-sd/microsd.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <vector>
+
+// diskio.h relies on the types from ff.h
+#include <libhal-sd/ff.h>
+
+#include <libhal-sd/diskio.h>
+
+#include <boost/ut.hpp>
+
+#include "simulated_card.hpp"
+
+namespace {
+constexpr std::size_t fat_image_size = 1024 * 1024;
+
+/// Format a FAT12 volume without a partition table, like f_mkfs with FM_SFD
+/// would. FF_USE_MKFS is off, so FatFs cannot do this itself.
+std::vector<hal::byte> make_fat_image()
+{
+  constexpr uint16_t sectors = fat_image_size / 512;
+  constexpr uint16_t reserved_sectors = 1;
+  constexpr hal::byte fat_count = 2;
+  constexpr uint16_t fat_sectors = 2;
+  constexpr uint16_t root_entries = 512;
+  // 4 sectors per cluster lets FatFs hand multi-block writes to the driver
+  constexpr hal::byte cluster_sectors = 4;
+
+  std::vector<hal::byte> image(fat_image_size);
+  auto const store = [&image](std::size_t p_offset, uint16_t p_value) {
+    image[p_offset] = static_cast<hal::byte>(p_value & 0xFF);
+    image[p_offset + 1] = static_cast<hal::byte>(p_value >> 8);
+  };
+  auto const copy = [&image](std::size_t p_offset, char const* p_text) {
+    std::memcpy(image.data() + p_offset, p_text, std::strlen(p_text));
+  };
+
+  copy(0, "\xEB\x3C\x90MSDOS5.0");
+  store(11, 512);  // BPB_BytsPerSec
+  image[13] = cluster_sectors;
+  store(14, reserved_sectors);
+  image[16] = fat_count;
+  store(17, root_entries);
+  store(19, sectors);  // BPB_TotSec16
+  image[21] = 0xF8;    // BPB_Media: fixed disk
+  store(22, fat_sectors);
+  image[36] = 0x80;  // BS_DrvNum
+  image[38] = 0x29;  // BS_BootSig
+  copy(43, "NO NAME    FAT12   ");
+  store(510, 0xAA55);
+
+  // The first two FAT entries hold the media byte and the end of chain mark
+  for (std::size_t fat = 0; fat < fat_count; fat++) {
+    auto const offset = (reserved_sectors + fat * fat_sectors) * 512;
+    copy(offset, "\xF8\xFF\xFF");
+  }
+
+  return image;
+}
+}  // namespace
+
+// Card behind FatFs drive 0, defined in sdcard_diskio.cpp
+extern hal::sd::microsd_card* sd;
+
+DWORD get_fattime()
+{
+  // 2023-10-01 12:00:00
+  return DWORD{ 2023 - 1980 } << 25 | DWORD{ 10 } << 21 | DWORD{ 1 } << 16 |
+         DWORD{ 12 } << 11;
+}
+
+namespace hal::sd {
+void fatfs_test()
+{
+  using namespace boost::ut;
+
+  "FatFs on a simulated card"_test = []() {
+    // Setup
+    auto fat_image = make_fat_image();
+    simulated_card fat_card(fat_image);
+    microsd_card card(fat_card, fat_card.chip_select());
+    ::sd = &card;
+    FATFS fs{};
+    FIL file{};
+    std::vector<hal::byte> data(5000);
+    for (std::size_t i = 0; i < data.size(); i++) {
+      data[i] = static_cast<hal::byte>(i * 13 + 5);
+    }
+    std::vector<hal::byte> read_back(data.size());
+    auto const first_sector = std::span(data).first(512);
+    auto const on_card = [&fat_image, &first_sector]() {
+      return !std::ranges::search(fat_image, first_sector).empty();
+    };
+    UINT count = 0;
+
+    // Exercise + Verify
+    expect(f_mount(&fs, "", 1) == FR_OK);
+
+    expect(f_open(&file, "DATA.BIN", FA_WRITE | FA_CREATE_ALWAYS) == FR_OK);
+    expect(f_write(&file, data.data(), data.size(), &count) == FR_OK);
+    expect(count == data.size());
+    expect(f_close(&file) == FR_OK);
+    expect(on_card());
+
+    expect(f_open(&file, "DATA.BIN", FA_READ) == FR_OK);
+    expect(f_read(&file, read_back.data(), read_back.size(), &count) == FR_OK);
+    expect(count == data.size());
+    expect(read_back == data);
+    expect(f_close(&file) == FR_OK);
+
+    // Deleting the file trims its clusters, which erases them
+    expect(f_unlink("DATA.BIN") == FR_OK);
+    FILINFO info{};
+    expect(f_stat("DATA.BIN", &info) == FR_NO_FILE);
+    expect(!on_card());
+
+    LBA_t sector_count = 0;
+    DWORD block_size = 0;
+    expect(disk_ioctl(0, GET_SECTOR_COUNT, &sector_count) == RES_OK);
+    expect(disk_ioctl(0, GET_BLOCK_SIZE, &block_size) == RES_OK);
+    expect(sector_count == fat_image.size() / 512);
+    expect(block_size == card.info().allocation_unit_sectors());
+
+    expect(f_unmount("") == FR_OK);
+    ::sd = nullptr;
+    expect(fat_card.protocol_errors() == 0);
+  };
+}
+}  // namespace hal::sd
@@ -14,9 +14,11 @@
 
 namespace hal::sd {
 extern void sd_test();
+extern void fatfs_test();
 }  // namespace hal::sd
 
 int main()
 {
   hal::sd::sd_test();
+  hal::sd::fatfs_test();
 }
\ No newline at end of file
@@ -14,18 +14,748 @@
 
 #include <libhal-sd/microsd.hpp>
 
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <vector>
+
+#include <libhal-sd/async.hpp>
+#include <libhal-sd/mirrored.hpp>
+#include <libhal-sd/spi_bus.hpp>
+#include <libhal-sd/striped.hpp>
+
 #include <boost/ut.hpp>
 
+#include "simulated_card.hpp"
+
 namespace hal::sd {
-void microsd_test()
+namespace {
+constexpr std::size_t image_size = 1024 * 1024;
+
+std::vector<hal::byte> make_image(std::size_t p_size = image_size)
+{
+  std::vector<hal::byte> image(p_size);
+  for (std::size_t i = 0; i < image.size(); i++) {
+    image[i] = static_cast<hal::byte>(i * 7 + i / 512);
+  }
+  return image;
+}
+
+bool holds(std::vector<hal::byte> const& p_image,
+           uint32_t p_block,
+           std::span<hal::byte const> p_data)
+{
+  return std::ranges::equal(
+    p_data, std::span(p_image).subspan(p_block * 512, p_data.size()));
+}
+
+async_task copy_task(executor&,
+                     microsd_card& p_card,
+                     uint32_t p_from,
+                     uint32_t p_to,
+                     std::span<hal::byte> p_buffer)
+{
+  co_await async_read_blocks(p_card, p_from, p_buffer);
+  co_await async_write_blocks(p_card, p_to, p_buffer);
+}
+}  // namespace
+
+void sd_test()
 {
   using namespace boost::ut;
-  using namespace std::literals;
+  using namespace std::chrono_literals;
+
+  "microsd_card::init()"_test = []() {
+    for (bool high_capacity : { true, false }) {
+      // Setup
+      auto image = make_image();
+      simulated_card::settings card_settings;
+      card_settings.high_capacity = high_capacity;
+      simulated_card card(image, card_settings);
+      microsd_card::settings settings;
+      settings.crc = true;
+      settings.high_speed = true;
+
+      // Exercise
+      microsd_card sd(card, card.chip_select(), settings);
+
+      // Verify
+      expect(sd.info().sector_count() == image.size() / 512);
+      expect(sd.info().block_addressing() == high_capacity);
+      expect(card.crc_enabled());
+      expect(card.high_speed_enabled());
+      expect(sd.clock_rate() == card.clock_rate());
+      expect(sd.info().sd_status.speed_class() == 10);
+      expect(sd.info().allocation_unit_sectors() == 8192);
+      expect(card.protocol_errors() == 0);
+    }
+  };
+
+  "microsd_card reads the allocation unit sizes"_test = []() {
+    constexpr uint32_t kib = 1024;
+    constexpr uint32_t mib = 1024 * kib;
+    struct expected_sizes
+    {
+      uint32_t allocation_unit;
+      uint32_t uhs_allocation_unit;
+    };
+    constexpr std::array<expected_sizes, 9> cases = { {
+      { 512 * kib, 0 },
+      { 1 * mib, 1 * mib },
+      { 4 * mib, 4 * mib },
+      { 8 * mib, 8 * mib },
+      { 12 * mib, 12 * mib },
+      { 16 * mib, 16 * mib },
+      { 24 * mib, 24 * mib },
+      { 32 * mib, 32 * mib },
+      { 64 * mib, 64 * mib },
+    } };
+
+    for (auto const& expected : cases) {
+      // Setup
+      auto image = make_image();
+      simulated_card::settings card_settings;
+      card_settings.allocation_unit = expected.allocation_unit;
+      simulated_card card(image, card_settings);
+
+      // Exercise
+      microsd_card sd(card, card.chip_select());
+
+      // Verify
+      auto const& status = sd.info().sd_status;
+      expect(status.allocation_unit_size() == expected.allocation_unit);
+      expect(status.uhs_allocation_unit_size() ==
+             expected.uhs_allocation_unit);
+    }
+  };
+
+  "microsd_card::init() without a card"_test = []() {
+    // Setup
+    auto image = make_image();
+    simulated_card card(image);
+    // A chip select that never reaches the card leaves MISO floating high
+    struct unconnected_pin : public hal::output_pin
+    {
+      void driver_configure(settings const&) override
+      {
+      }
+      void driver_level(bool) override
+      {
+      }
+      bool driver_level() override
+      {
+        return true;
+      }
+    } unconnected;
+
+    // Exercise + Verify
+    expect(throws<hal::no_such_device>(
+      [&]() { microsd_card sd(card, unconnected); }));
+  };
+
+  "microsd_card checks CMD55 before application commands"_test = []() {
+    // Setup
+    auto image = make_image();
+    simulated_card card(image);
+    std::vector<hal::byte> blocks(512 * 2, 0x4B);
+
+    // Exercise + Verify
+    card.reject_application_commands(1);
+    expect(throws<hal::operation_not_supported>(
+      [&]() { microsd_card sd(card, card.chip_select()); }));
+
+    microsd_card sd(card, card.chip_select());
+    card.reject_application_commands(1);
+    expect(throws<hal::operation_not_supported>(
+      [&]() { sd.read_sd_status(); }));
+
+    // ACMD23 is only a hint, the write goes ahead with CMD25 alone
+    card.reject_application_commands(1);
+    auto const commands = card.command_count();
+    auto const pre_erases = card.pre_erase_count();
+    sd.write_blocks(20, blocks);
+    expect(holds(image, 20, blocks));
+    expect(card.command_count() - commands == 2);
+    expect(card.pre_erase_count() == pre_erases);
+    expect(card.protocol_errors() == 0);
+  };
+
+  "microsd_card waits the whole NCR for a response"_test = []() {
+    // Setup
+    auto image = make_image();
+    simulated_card::settings card_settings;
+    card_settings.response_delay = 8;
+    simulated_card card(image, card_settings);
+    std::vector<hal::byte> blocks(512 * 3, 0x3C);
+    std::vector<hal::byte> read_back(blocks.size());
+
+    // Exercise
+    microsd_card sd(card, card.chip_select());
+    sd.write_blocks(12, blocks);
+    sd.read_blocks(12, read_back);
+
+    // Verify
+    expect(holds(image, 12, blocks));
+    expect(read_back == blocks);
+    expect(card.protocol_errors() == 0);
+  };
+
+  "microsd_card read and write"_test = []() {
+    for (bool crc : { false, true }) {
+      // Setup
+      auto image = make_image();
+      simulated_card card(image);
+      microsd_card::settings settings;
+      settings.crc = crc;
+      microsd_card sd(card, card.chip_select(), settings);
+      std::array<hal::byte, 512> block{};
+      std::vector<hal::byte> blocks(512 * 5);
+      std::ranges::fill(blocks, 0x5A);
+      std::array<hal::byte, 100> head{};
+      std::array<hal::byte, 924> tail{};
+      head.fill(0x11);
+      tail.fill(0x22);
+      std::array<std::span<hal::byte const>, 2> segments = {
+        std::span<hal::byte const>(head),
+        std::span<hal::byte const>(tail),
+      };
+
+      // Exercise + Verify
+      sd.read_block(3, std::span(block));
+      expect(holds(image, 3, block));
+
+      std::vector<hal::byte> read_back(512 * 5);
+      sd.read_blocks(10, read_back);
+      expect(holds(image, 10, read_back));
+
+      block.fill(0xA5);
+      sd.write_block(7, std::span<hal::byte const, 512>(block));
+      expect(holds(image, 7, block));
+
+      sd.write_blocks(20, blocks);
+      expect(holds(image, 20, blocks));
+      expect(card.pre_erase_count() == 5);
+
+      sd.write_blocks_v(30, segments);
+      expect(holds(image, 30, head));
+      expect(image[30 * 512 + 100] == 0x22 && image[32 * 512 - 1] == 0x22);
+
+      expect(card.protocol_errors() == 0);
+    }
+  };
+
+  "microsd_card rejects out of range blocks"_test = []() {
+    // Setup
+    auto image = make_image();
+    simulated_card card(image);
+    microsd_card sd(card, card.chip_select());
+    std::array<hal::byte, 512> block{};
+
+    // Exercise + Verify
+    expect(throws<hal::argument_out_of_domain>(
+      [&]() { sd.read_block(1'000'000, std::span(block)); }));
+    expect(throws<hal::argument_out_of_domain>([&]() {
+      sd.write_blocks(0, std::span<hal::byte const>(block).first(100));
+    }));
+    sd.read_block(0, std::span(block));
+    expect(holds(image, 0, block));
+
+    // A stream the card never started is not stopped with CMD12 either
+    std::vector<hal::byte> blocks(512 * 2);
+    auto const commands = card.command_count();
+    sd.start_read(1'000'000, blocks);
+    auto status = microsd_card::io_status::pending;
+    while ((status = sd.poll()) == microsd_card::io_status::pending) {
+    }
+    expect(status == microsd_card::io_status::error);
+    expect(card.command_count() - commands == 1);
+    expect(card.protocol_errors() == 0);
+  };
+
+  "microsd_card retries blocks that fail their CRC"_test = []() {
+    // Setup
+    auto image = make_image();
+    simulated_card card(image);
+    microsd_card::settings settings;
+    settings.crc = true;
+    microsd_card sd(card, card.chip_select(), settings);
+    std::vector<hal::byte> data(512 * 4);
+
+    // Exercise
+    card.corrupt_reads(2);
+    sd.read_blocks(40, data);
+
+    // Verify
+    expect(holds(image, 40, data));
+
+    // Exercise + Verify
+    card.corrupt_reads(100);
+    expect(throws<hal::io_error>([&]() { sd.read_blocks(40, data); }));
+    card.corrupt_reads(0);
+  };
 
-  "microsd::create()"_test = []() {
+  "microsd_card resends blocks rejected for their CRC"_test = []() {
     // Setup
+    auto image = make_image();
+    simulated_card::settings card_settings;
+    // Longer than the lookahead, so the busy signal has to be waited out
+    card_settings.program_busy = 64;
+    simulated_card card(image, card_settings);
+    microsd_card sd(card, card.chip_select());
+    std::array<hal::byte, 512> block{};
+    block.fill(0x66);
+    std::vector<hal::byte> blocks(512 * 3, 0x77);
+
     // Exercise
+    card.corrupt_writes(1);
+    sd.write_block(9, std::span<hal::byte const, 512>(block));
+    card.corrupt_writes(1);
+    sd.write_blocks(50, blocks);
+    card.corrupt_writes(1);
+    sd.start_write(60, blocks);
+    auto status = microsd_card::io_status::pending;
+    while ((status = sd.poll()) == microsd_card::io_status::pending) {
+    }
+
+    // Verify
+    expect(holds(image, 9, block));
+    expect(holds(image, 50, blocks));
+    expect(status == microsd_card::io_status::done);
+    expect(holds(image, 60, blocks));
+    expect(card.protocol_errors() == 0);
+  };
+
+  "microsd_card stops a stream that fails part way"_test = []() {
+    // Setup
+    auto image = make_image();
+    simulated_card::settings card_settings;
+    // Longer than settings::write_timeout
+    card_settings.program_time = 700ms;
+    simulated_card card(image, card_settings);
+    microsd_card sd(card, card.chip_select());
+    std::vector<hal::byte> blocks(512 * 3, 0x55);
+    std::array<hal::byte, 512> block{};
+
+    // Exercise + Verify
+    card.stall_next_read(1'000'000);
+    expect(throws<hal::timed_out>([&]() { sd.read_blocks(70, blocks); }));
+    sd.read_block(4, std::span(block));
+    expect(holds(image, 4, block));
+
+    expect(throws<hal::timed_out>([&]() { sd.write_blocks(80, blocks); }));
+    sd.read_block(5, std::span(block));
+    expect(holds(image, 5, block));
+
+    expect(card.protocol_errors() == 0);
+  };
+
+  "microsd_card reports write errors"_test = []() {
+    // Setup
+    auto image = make_image();
+    simulated_card card(image);
+    microsd_card::settings settings;
+    settings.verify_writes = true;
+    microsd_card sd(card, card.chip_select(), settings);
+    std::array<hal::byte, 512> block{};
+    block.fill(0x33);
+    auto const written = std::span<hal::byte const, 512>(block);
+
+    // Exercise + Verify
+    card.fail_writes(1);
+    expect(throws<hal::io_error>([&]() { sd.write_block(5, written); }));
+
+    // The stale error from above is read back and found to be harmless
+    sd.write_block(6, written);
+    expect(holds(image, 6, block));
+
+    // A clean write costs CMD24 and CMD13 and nothing else
+    auto const commands = card.command_count();
+    sd.write_block(7, written);
+    expect(card.command_count() - commands == 2);
+
+    card.lose_writes(1);
+    block.fill(0x44);
+    expect(throws<hal::io_error>([&]() { sd.write_block(8, written); }));
+    expect(!holds(image, 8, block));
+    expect(card.protocol_errors() == 0);
+  };
+
+  "microsd_card stops a rejected stream once the card is ready"_test = []() {
+    // Setup
+    auto image = make_image();
+    simulated_card::settings card_settings;
+    // Longer than the lookahead, so the stop token has to wait for the card
+    card_settings.program_busy = 100;
+    simulated_card card(image, card_settings);
+    microsd_card sd(card, card.chip_select());
+    std::vector<hal::byte> blocks(512 * 4, 0x5A);
+    std::array<hal::byte, 512> block{};
+
+    // Exercise
+    card.fail_writes(1);
+    sd.start_write(10, blocks);
+    auto status = microsd_card::io_status::pending;
+    while ((status = sd.poll()) == microsd_card::io_status::pending) {
+    }
+    sd.read_block(0, std::span(block));
+
+    // Verify
+    expect(status == microsd_card::io_status::error);
+    expect(holds(image, 0, block));
+    expect(card.protocol_errors() == 0);
+  };
+
+  "microsd_card::erase()"_test = []() {
+    // Setup
+    auto image = make_image();
+    simulated_card card(image);
+    microsd_card sd(card, card.chip_select());
+
+    // Exercise
+    sd.erase(30, 31);
+
+    // Verify
+    expect(image[30 * 512] == 0 && image[32 * 512 - 1] == 0);
+    expect(image[32 * 512] == make_image(32 * 512 + 1)[32 * 512]);
+    expect(throws<hal::argument_out_of_domain>([&]() { sd.erase(5, 4); }));
+  };
+
+  "microsd_card non-blocking transfers"_test = []() {
+    // Setup
+    auto image = make_image();
+    simulated_card card(image);
+    microsd_card::settings settings;
+    settings.poll_budget = 16;
+    microsd_card sd(card, card.chip_select(), settings);
+    std::vector<hal::byte> data(512 * 3);
+    std::ranges::fill(data, 0x6C);
+    std::vector<hal::byte> read_back(data.size());
+
+    // Exercise
+    sd.start_write(50, data);
+    auto status = microsd_card::io_status::pending;
+    int polls = 0;
+    while ((status = sd.poll()) == microsd_card::io_status::pending) {
+      polls++;
+    }
+    sd.start_read(50, read_back);
+    expect(throws<hal::device_or_resource_busy>(
+      [&]() { sd.read_blocks(50, read_back); }));
+    while (sd.poll() == microsd_card::io_status::pending) {
+      continue;
+    }
+
+    // Verify
+    expect(status == microsd_card::io_status::done);
+    expect(polls > 1);
+    expect(holds(image, 50, data));
+    expect(read_back == data);
+    expect(!sd.transfer_pending());
+  };
+
+  "microsd_card write-behind"_test = []() {
+    // Setup
+    auto image = make_image();
+    simulated_card card(image);
+    microsd_card::settings settings;
+    settings.write_behind = true;
+    microsd_card sd(card, card.chip_select(), settings);
+    std::array<hal::byte, 512> block{};
+    block.fill(0x11);
+
+    // Exercise
+    sd.write_block(40, std::span<hal::byte const, 512>(block));
+    bool const busy_after_write = sd.busy();
+    sd.write_block(41, std::span<hal::byte const, 512>(block));
+    sd.wait_ready();
+
+    // Verify
+    expect(busy_after_write);
+    expect(!sd.busy());
+    expect(holds(image, 40, block) && holds(image, 41, block));
+    expect(card.protocol_errors() == 0);
+  };
+
+  "microsd_card::transaction"_test = []() {
+    // Setup
+    auto image = make_image();
+    simulated_card card(image);
+    microsd_card sd(card, card.chip_select());
+    std::array<hal::byte, 512> block{};
+    auto const selections = card.select_count();
+
+    // Exercise
+    {
+      microsd_card::transaction batch(sd);
+      sd.read_block(1, std::span(block));
+      sd.read_block(2, std::span(block));
+      expect(throws<hal::device_or_resource_busy>([&]() { sd.init(); }));
+    }
+
+    // Verify
+    expect(card.select_count() - selections == 1);
+  };
+
+  "async_read_blocks and async_write_blocks"_test = []() {
+    // Setup
+    auto image = make_image();
+    simulated_card card(image);
+    microsd_card sd(card, card.chip_select());
+    static_executor<1024, 2> runner;
+    std::vector<hal::byte> first(1024);
+    std::vector<hal::byte> second(512);
+
+    // Exercise
+    runner.spawn(copy_task(runner, sd, 1, 100, first));
+    runner.spawn(copy_task(runner, sd, 5, 200, second));
+    runner.run();
+
+    // Verify
+    auto const original = make_image();
+    expect(holds(image, 100, std::span(original).subspan(512, 1024)));
+    expect(holds(image, 200, std::span(original).subspan(5 * 512, 512)));
+    expect(runner.pool().available() == 2);
+  };
+
+  "spi_bus shares one bus between two cards"_test = []() {
+    // Setup
+    auto image_a = make_image();
+    auto image_b = make_image();
+    simulated_card card_a(image_a);
+    simulated_card card_b(image_b);
+    // Only card_a is wired to the bus, card_b lends its chip select to a
+    // second device that contends for it
+    spi_bus bus(card_a);
+    spi_bus::device slot_a(bus, card_a.chip_select());
+    spi_bus::device slot_b(bus, card_b.chip_select());
+    microsd_card sd_a(slot_a, slot_a.chip_select());
+    std::array<hal::byte, 512> block{};
+
+    // Exercise
+    sd_a.read_block(0, std::span(block));
+    auto const reconfigurations = bus.reconfigurations();
+    sd_a.read_block(1, std::span(block));
+
+    // Verify
+    expect(bus.reconfigurations() == reconfigurations);
+    expect(!bus.busy());
+    {
+      microsd_card::transaction held(sd_a);
+      expect(bus.busy() && slot_a.selected());
+      expect(throws<hal::device_or_resource_busy>(
+        [&]() { slot_b.chip_select().level(false); }));
+      expect(!slot_b.selected());
+    }
+    expect(!bus.busy());
+  };
+
+  "striped_device"_test = []() {
+    // Setup
+    auto image_a = make_image();
+    auto image_b = make_image();
+    simulated_card card_a(image_a);
+    simulated_card card_b(image_b);
+    microsd_card sd_a(card_a, card_a.chip_select());
+    microsd_card sd_b(card_b, card_b.chip_select());
+    std::array<microsd_card*, 2> cards = { &sd_a, &sd_b };
+    striped_device striped(cards, 4);
+    std::vector<hal::byte> data(512 * 10);
+    for (std::size_t i = 0; i < data.size(); i++) {
+      data[i] = static_cast<hal::byte>(i / 512 + 1);
+    }
+    std::vector<hal::byte> read_back(data.size());
+
+    // Exercise
+    striped.write_blocks(2, data);
+    striped.read_blocks(2, read_back);
+
+    // Verify
+    expect(striped.block_count() == 2 * 2048);
+    expect(read_back == data);
+    // Blocks 2-3 land on card a, 4-7 on card b, 8-11 on card a again
+    expect(image_a[2 * 512] == 1 && image_a[3 * 512] == 2);
+    expect(image_b[0] == 3 && image_b[3 * 512] == 6);
+    expect(image_a[4 * 512] == 7 && image_a[7 * 512] == 10);
+    expect(throws<hal::argument_out_of_domain>(
+      [&]() { striped.read_blocks(striped.block_count(), read_back); }));
+  };
+
+  "mirrored_device"_test = []() {
+    // Setup
+    auto image_a = make_image();
+    auto image_b = make_image();
+    simulated_card card_a(image_a);
+    simulated_card card_b(image_b);
+    microsd_card sd_a(card_a, card_a.chip_select());
+    microsd_card sd_b(card_b, card_b.chip_select());
+    mirrored_device mirror(sd_a, sd_b);
+    std::vector<hal::byte> data(512 * 4);
+    std::ranges::fill(data, 0x3C);
+    std::vector<hal::byte> read_back(data.size());
+
+    // Exercise + Verify
+    mirror.write_blocks(10, data);
+    expect(holds(image_a, 10, data) && holds(image_b, 10, data));
+
+    auto const commands_a = card_a.command_count();
+    auto const commands_b = card_b.command_count();
+    mirror.read_blocks(10, read_back);
+    expect(read_back == data);
+    expect(card_a.command_count() > commands_a);
+    expect(card_b.command_count() > commands_b);
+
+    card_b.fail_writes(1);
+    std::ranges::fill(data, 0xC3);
+    mirror.write_blocks(20, data);
+    expect(mirror.online(0) && !mirror.online(1));
+    expect(holds(image_a, 20, data));
+
+    mirror.read_blocks(20, read_back);
+    expect(read_back == data);
+  };
+
+  "mirrored_device stops reading a slow card"_test = []() {
+    // Setup
+    auto image_a = make_image();
+    auto image_b = make_image();
+    simulated_card::settings slow_settings;
+    slow_settings.read_latency = 2ms;
+    simulated_card card_a(image_a);
+    simulated_card card_b(image_b, slow_settings);
+    microsd_card sd_a(card_a, card_a.chip_select());
+    microsd_card sd_b(card_b, card_b.chip_select());
+    mirrored_device mirror(sd_a, sd_b);
+    std::vector<hal::byte> read_back(512 * 4);
+
+    // Exercise
+    for (int i = 0; i < 8; i++) {
+      mirror.read_blocks(0, read_back);
+    }
+    auto const commands_b = card_b.command_count();
+    for (uint32_t i = 0; i < mirrored_device::probe_interval; i++) {
+      mirror.read_blocks(0, read_back);
+    }
+    auto const reads_b = (card_b.command_count() - commands_b) / 2;
+
+    // Verify
+    expect(mirror.slow(1) && !mirror.slow(0));
+    expect(mirror.online_count() == 2);
+    // CMD18 and CMD12 for the one read that measures the card again
+    expect(reads_b == 1);
+    expect(holds(image_a, 0, read_back));
+
+    std::vector<hal::byte> data(512 * 2, 0x96);
+    mirror.write_blocks(30, data);
+    expect(holds(image_b, 30, data));
+  };
+
+  "simulated_card timing"_test = []() {
+    // Setup
+    auto image = make_image();
+    simulated_card::settings card_settings;
+    card_settings.program_time = 1ms;
+    card_settings.read_latency = 100us;
+    simulated_card card(image, card_settings);
+    microsd_card sd(card, card.chip_select());
+    std::vector<hal::byte> data(512 * 8);
+    // Every byte takes 8 cycles of the 25 MHz clock chosen by init()
+    auto const byte_time = simulated_clock::duration(320.0);
+
+    // Exercise
+    auto const start = card.clock().now();
+    auto const cycles = card.clock_cycles();
+    sd.read_blocks(0, data);
+    auto const read_time = card.clock().now() - start;
+    sd.write_blocks(0, data);
+    auto const write_time = card.clock().now() - start - read_time;
+
+    // Verify
+    expect(sd.clock_rate() == 25'000'000.0f);
+    expect(read_time >= 8 * 100us + data.size() * byte_time);
+    expect(write_time >= 8 * 1ms + data.size() * byte_time);
+    expect(write_time < 8 * 1ms + 2 * data.size() * byte_time);
+    auto const cycle_time = simulated_clock::duration(40.0);
+    auto const counted = (card.clock_cycles() - cycles) * cycle_time;
+    expect(std::chrono::abs(counted - (card.clock().now() - start)) < 1ns);
+  };
+
+  "simulated_card allocation unit switches"_test = []() {
+    // Setup
+    auto image = make_image();
+    simulated_card::settings card_settings;
+    card_settings.allocation_unit = 64 * 1024;
+    card_settings.allocation_unit_switch = 5ms;
+    simulated_card card(image, card_settings);
+    microsd_card sd(card, card.chip_select());
+    std::vector<hal::byte> data(512 * 4);
+
+    // Exercise
+    sd.write_blocks(120, data);
+    auto const start = card.clock().now();
+    sd.write_blocks(126, data);
+    auto const crossing_time = card.clock().now() - start;
+
+    // Verify
+    expect(sd.info().allocation_unit_sectors() == 128);
+    expect(card.allocation_unit_switches() == 1);
+    expect(crossing_time >= 5ms);
+  };
+
+  "simulated_card garbage collection stalls"_test = []() {
+    // Setup
+    simulated_card::settings card_settings;
+    card_settings.gc_probability = 0.25;
+    card_settings.gc_stall = 20ms;
+    card_settings.seed = 7;
+    std::vector<hal::byte> data(512 * 32);
+    std::array<uint32_t, 2> stalls{};
+    std::array<simulated_clock::duration, 2> times{};
+
+    // Exercise
+    for (std::size_t run = 0; run < 2; run++) {
+      auto image = make_image();
+      simulated_card card(image, card_settings);
+      microsd_card sd(card, card.chip_select());
+      auto const start = card.clock().now();
+      sd.write_blocks(0, data);
+      stalls[run] = card.gc_stalls();
+      times[run] = card.clock().now() - start;
+    }
+
+    // Verify
+    expect(stalls[0] > 0 && stalls[0] < 32);
+    expect(stalls[0] == stalls[1] && times[0] == times[1]);
+    expect(times[0] >= stalls[0] * 20ms);
+  };
+
+  "striped_device overlaps the cards' busy time"_test = []() {
+    // Setup
+    simulated_card::settings card_settings;
+    card_settings.program_time = 1ms;
+    std::vector<hal::byte> data(512 * 32);
+    auto write_time = [&](std::size_t p_card_count) {
+      simulated_clock clock;
+      std::array<std::vector<hal::byte>, 2> images = { make_image(),
+                                                       make_image() };
+      simulated_card card_a(images[0], card_settings, clock);
+      simulated_card card_b(images[1], card_settings, clock);
+      microsd_card::settings settings;
+      microsd_card sd_a(card_a, card_a.chip_select(), clock, settings);
+      microsd_card sd_b(card_b, card_b.chip_select(), clock, settings);
+      std::array<microsd_card*, 2> cards = { &sd_a, &sd_b };
+      auto const used = std::span(cards).first(p_card_count);
+      striped_device striped(used, 8);
+      auto const start = clock.now();
+      striped.write_blocks(0, data);
+      return clock.now() - start;
+    };
+
+    // Exercise
+    auto const one_card = write_time(1);
+    auto const two_cards = write_time(2);
+
     // Verify
+    expect(two_cards < one_card * 0.65);
   };
-};
+}
 }  // namespace hal::sd
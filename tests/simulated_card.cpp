@@ -0,0 +1,865 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "simulated_card.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <utility>
+
+#include <libhal/error.hpp>
+
+#include <libhal-sd/crc.hpp>
+
+namespace hal::sd {
+namespace {
+constexpr std::size_t block_size = 512;
+
+// R1 response bits
+constexpr hal::byte r1_idle = 0x01;
+constexpr hal::byte r1_illegal_command = 0x04;
+constexpr hal::byte r1_crc_error = 0x08;
+constexpr hal::byte r1_address_error = 0x20;
+constexpr hal::byte r1_parameter_error = 0x40;
+
+// Tokens
+constexpr hal::byte start_token = 0xFE;
+constexpr hal::byte multi_write_token = 0xFC;
+constexpr hal::byte stop_token = 0xFD;
+constexpr hal::byte out_of_range_token = 0x08;
+constexpr hal::byte data_accepted = 0xE5;
+constexpr hal::byte data_crc_error = 0xEB;
+constexpr hal::byte data_write_error = 0xED;
+
+/// Byte clocked out directly after CMD12, deliberately not 0xFF
+constexpr hal::byte stuff_byte = 0x3F;
+/// Longest gap between a command and its R1 that the NCR limit allows
+constexpr std::size_t max_response_delay = 8;
+constexpr uint32_t stream_forever = std::numeric_limits<uint32_t>::max();
+
+/// Inverse of extract_bits(): store p_value using the spec's bit numbering
+void insert_bits(std::span<hal::byte> p_register,
+                 std::size_t p_msb,
+                 std::size_t p_lsb,
+                 uint32_t p_value)
+{
+  auto const last_bit = p_register.size() * 8 - 1;
+  for (auto bit = p_lsb; bit <= p_msb; bit++) {
+    auto const position = last_bit - bit;
+    auto const mask = static_cast<hal::byte>(1U << (7 - position % 8));
+    if ((p_value >> (bit - p_lsb)) & 1U) {
+      p_register[position / 8] |= mask;
+    } else {
+      p_register[position / 8] &= static_cast<hal::byte>(~mask);
+    }
+  }
+}
+
+/// AU_SIZE code of the SD Status for an allocation unit, 0 if there is none
+uint32_t allocation_unit_code(std::size_t p_bytes)
+{
+  constexpr std::size_t kib = 1024;
+  constexpr std::size_t mib = 1024 * kib;
+  for (uint32_t code = 1; code <= 9; code++) {
+    if (p_bytes == (16 * kib) << (code - 1)) {
+      return code;
+    }
+  }
+  constexpr std::array<std::size_t, 6> large = {
+    8 * mib, 12 * mib, 16 * mib, 24 * mib, 32 * mib, 64 * mib,
+  };
+  auto const match = std::ranges::find(large, p_bytes);
+  if (match == large.end()) {
+    return 0;
+  }
+  return 0xA + static_cast<uint32_t>(match - large.begin());
+}
+
+/// CSD and CID end with their own CRC7 followed by a 1
+void seal_register(std::span<hal::byte, 16> p_register)
+{
+  auto const crc = crc7(p_register.first<15>());
+  p_register[15] = static_cast<hal::byte>((crc << 1) | 1);
+}
+}  // namespace
+
+void simulated_clock::advance(duration p_duration)
+{
+  m_now += p_duration;
+}
+
+simulated_clock::duration simulated_clock::now() const
+{
+  return m_now;
+}
+
+hal::hertz simulated_clock::driver_frequency()
+{
+  return 1'000'000'000.0f;
+}
+
+std::uint64_t simulated_clock::driver_uptime()
+{
+  return static_cast<std::uint64_t>(m_now.count());
+}
+
+simulated_card::select_pin::select_pin(simulated_card& p_card)
+  : m_card(&p_card)
+{
+}
+
+void simulated_card::select_pin::driver_configure(
+  hal::output_pin::settings const&)
+{
+}
+
+void simulated_card::select_pin::driver_level(bool p_high)
+{
+  m_level = p_high;
+  m_card->select(!p_high);
+}
+
+bool simulated_card::select_pin::driver_level()
+{
+  return m_level;
+}
+
+simulated_card::simulated_card(std::span<hal::byte> p_image)
+  : simulated_card(p_image, settings{})
+{
+}
+
+simulated_card::simulated_card(std::span<hal::byte> p_image,
+                               settings const& p_settings)
+  : m_image(p_image)
+  , m_settings(p_settings)
+  , m_chip_select(*this)
+  , m_clock(&m_own_clock)
+  , m_random(p_settings.seed)
+{
+}
+
+simulated_card::simulated_card(std::span<hal::byte> p_image,
+                               settings const& p_settings,
+                               simulated_clock& p_clock)
+  : m_image(p_image)
+  , m_settings(p_settings)
+  , m_chip_select(*this)
+  , m_clock(&p_clock)
+  , m_random(p_settings.seed)
+{
+}
+
+hal::output_pin& simulated_card::chip_select()
+{
+  return m_chip_select;
+}
+
+simulated_clock& simulated_card::clock()
+{
+  return *m_clock;
+}
+
+std::uint64_t simulated_card::bytes_clocked() const
+{
+  return m_bytes_clocked;
+}
+
+std::uint64_t simulated_card::clock_cycles() const
+{
+  return m_clock_cycles;
+}
+
+std::uint32_t simulated_card::allocation_unit_switches() const
+{
+  return m_allocation_unit_switches;
+}
+
+std::uint32_t simulated_card::gc_stalls() const
+{
+  return m_gc_stalls;
+}
+
+std::uint32_t simulated_card::select_count() const
+{
+  return m_selections;
+}
+
+std::uint32_t simulated_card::command_count() const
+{
+  return m_commands;
+}
+
+std::uint32_t simulated_card::protocol_errors() const
+{
+  return m_protocol_errors;
+}
+
+hal::hertz simulated_card::clock_rate() const
+{
+  return m_clock_rate;
+}
+
+bool simulated_card::crc_enabled() const
+{
+  return m_crc;
+}
+
+bool simulated_card::high_speed_enabled() const
+{
+  return m_high_speed;
+}
+
+std::uint32_t simulated_card::pre_erase_count() const
+{
+  return m_pre_erase;
+}
+
+void simulated_card::corrupt_reads(int p_count)
+{
+  m_corrupt_reads = p_count;
+}
+
+void simulated_card::corrupt_writes(int p_count)
+{
+  m_corrupt_writes = p_count;
+}
+
+void simulated_card::fail_writes(int p_count)
+{
+  m_fail_writes = p_count;
+}
+
+void simulated_card::lose_writes(int p_count)
+{
+  m_lose_writes = p_count;
+}
+
+void simulated_card::stall_next_read(std::size_t p_bytes)
+{
+  m_read_stall = p_bytes;
+}
+
+void simulated_card::reject_application_commands(int p_count)
+{
+  m_reject_application = p_count;
+}
+
+void simulated_card::driver_configure(hal::spi::settings const& p_settings)
+{
+  m_clock_rate = p_settings.clock_rate;
+}
+
+void simulated_card::driver_transfer(std::span<hal::byte const> p_data_out,
+                                     std::span<hal::byte> p_data_in,
+                                     hal::byte p_filler)
+{
+  auto const length = std::max(p_data_out.size(), p_data_in.size());
+  auto const byte_period = byte_time();
+
+  for (std::size_t i = 0; i < length; i++) {
+    auto const mosi = i < p_data_out.size() ? p_data_out[i] : p_filler;
+    auto const miso = exchange(mosi);
+    if (i < p_data_in.size()) {
+      p_data_in[i] = miso;
+    }
+    m_clock->advance(byte_period);
+    m_clock_cycles += 8;
+  }
+}
+
+void simulated_card::select(bool p_selected)
+{
+  if (m_selected && !p_selected) {
+    // The card releases MISO and forgets any partially received frame
+    m_frame_length = 0;
+    clear_output();
+  }
+  if (!m_selected && p_selected) {
+    m_selections++;
+  }
+  m_selected = p_selected;
+}
+
+hal::byte simulated_card::exchange(hal::byte p_mosi)
+{
+  if (!m_selected) {
+    return 0xFF;
+  }
+
+  m_bytes_clocked++;
+  // The card shifts out its next byte while the host's byte is shifted in, so
+  // anything the host's byte triggers shows up from the next exchange on.
+  auto const miso = next_output();
+  receive(p_mosi);
+  return miso;
+}
+
+hal::byte simulated_card::next_output()
+{
+  if (m_output_size == 0 && !programming() && m_reads_pending > 0) {
+    if (m_read_delay > 0) {
+      m_read_delay--;
+      return 0xFF;
+    }
+    if (m_clock->now() < m_read_ready) {
+      return 0xFF;
+    }
+
+    if (m_register_length > 0) {
+      queue_block(std::span(m_register).first(m_register_length));
+      m_register_length = 0;
+      m_reads_pending = 0;
+    } else if (m_read_block >= m_image.size() / block_size) {
+      queue(out_of_range_token);
+      m_reads_pending = 0;
+    } else {
+      queue_block(m_image.subspan(m_read_block * block_size, block_size));
+      m_read_block++;
+      if (m_reads_pending != stream_forever) {
+        m_reads_pending--;
+      }
+      m_read_delay = m_settings.access_delay;
+      // The latency of the next block starts once this one is shifted out
+      auto const queued = static_cast<double>(m_output_size);
+      m_read_ready =
+        m_clock->now() + queued * byte_time() + m_settings.read_latency;
+    }
+  }
+
+  if (m_output_size > 0) {
+    auto const value = m_output[m_output_head];
+    m_output_head = (m_output_head + 1) % m_output.size();
+    m_output_size--;
+    return value;
+  }
+
+  if (m_busy > 0) {
+    m_busy--;
+    return 0x00;
+  }
+  if (m_clock->now() < m_busy_until) {
+    return 0x00;
+  }
+
+  return 0xFF;
+}
+
+void simulated_card::receive(hal::byte p_mosi)
+{
+  bool const busy = m_output_size == 0 && programming();
+
+  switch (m_mode) {
+    case receive_mode::command:
+      if (m_frame_length == 0) {
+        if ((p_mosi & 0xC0) != 0x40) {
+          return;
+        }
+        if (busy) {
+          // Commands sent while the card holds MISO low are lost
+          m_protocol_errors++;
+          return;
+        }
+      }
+      m_frame[m_frame_length++] = p_mosi;
+      if (m_frame_length == m_frame.size()) {
+        m_frame_length = 0;
+        execute(m_frame);
+      }
+      return;
+
+    case receive_mode::write_token:
+      if (p_mosi == 0xFF) {
+        return;
+      }
+      if (busy) {
+        m_protocol_errors++;
+        return;
+      }
+      if (p_mosi == stop_token && m_write_multiple) {
+        m_mode = receive_mode::command;
+        queue(0xFF);
+        m_busy = m_settings.stop_busy;
+      } else if (p_mosi == (m_write_multiple ? multi_write_token
+                                             : start_token)) {
+        m_mode = receive_mode::write_data;
+        m_block_length = 0;
+      } else {
+        m_protocol_errors++;
+      }
+      return;
+
+    case receive_mode::write_data:
+      m_block[m_block_length++] = p_mosi;
+      if (m_block_length == m_block.size()) {
+        receive_block();
+      }
+      return;
+  }
+}
+
+void simulated_card::receive_block()
+{
+  auto const data = std::span(m_block).first<block_size>();
+  auto const received_crc = static_cast<uint16_t>(m_block[block_size] << 8 |
+                                                  m_block[block_size + 1]);
+
+  if (m_corrupt_writes > 0) {
+    m_corrupt_writes--;
+    queue(data_crc_error);
+  } else if (m_crc && crc16(data) != received_crc) {
+    queue(data_crc_error);
+  } else if (m_fail_writes > 0 ||
+             m_write_block >= m_image.size() / block_size) {
+    if (m_fail_writes > 0) {
+      m_fail_writes--;
+    }
+    m_write_error = true;
+    queue(data_write_error);
+  } else if (m_lose_writes > 0) {
+    m_lose_writes--;
+    m_write_error = true;
+    m_write_block++;
+    queue(data_accepted);
+  } else {
+    std::ranges::copy(data, m_image.begin() + m_write_block * block_size);
+    m_busy_until = m_clock->now() + program_time(m_write_block);
+    m_write_block++;
+    queue(data_accepted);
+  }
+
+  m_busy = m_settings.program_busy;
+  m_mode = m_write_multiple ? receive_mode::write_token : receive_mode::command;
+}
+
+void simulated_card::execute(std::array<hal::byte, 6> const& p_frame)
+{
+  m_commands++;
+
+  auto const index = static_cast<hal::byte>(p_frame[0] & 0x3F);
+  auto const argument = static_cast<uint32_t>(
+    p_frame[1] << 24 | p_frame[2] << 16 | p_frame[3] << 8 | p_frame[4]);
+  bool const application = std::exchange(m_application, false);
+
+  // A new command aborts whatever the card was still sending
+  clear_output();
+
+  // CMD0 and CMD8 are always CRC checked, everything else only after CMD59
+  bool const check_crc = m_crc || index == 0 || index == 8;
+  if (check_crc && crc7(std::span(p_frame).first<5>()) != p_frame[5] >> 1) {
+    respond(r1_crc_error | (m_idle ? r1_idle : 0));
+    return;
+  }
+
+  if (m_idle) {
+    bool const allowed = index == 0 || index == 8 || index == 55 ||
+                         index == 58 || index == 59 ||
+                         (application && index == 41);
+    if (!allowed) {
+      respond(r1_idle | r1_illegal_command);
+      return;
+    }
+  }
+
+  if (application) {
+    execute_application(index, argument);
+    return;
+  }
+
+  hal::byte const idle = m_idle ? r1_idle : 0;
+  uint32_t block = 0;
+
+  switch (index) {
+    case 0:
+      m_idle = true;
+      m_crc = false;
+      m_init_count = 0;
+      m_mode = receive_mode::command;
+      respond(r1_idle);
+      return;
+
+    case 6: {
+      std::array<hal::byte, 64> status{};
+      status[1] = 0x64;  // 100 mA
+      status[12] = 0x80;
+      status[13] = m_settings.high_speed ? 0x03 : 0x01;
+
+      auto const group1 = argument & 0x0F;
+      hal::byte result = m_high_speed ? 1 : 0;
+      if (group1 == 1) {
+        result = m_settings.high_speed ? 1 : 0x0F;
+      } else if (group1 != 0 && group1 != 0x0F) {
+        result = 0x0F;
+      }
+      status[16] = result;
+
+      if ((argument >> 31) && result == 1) {
+        m_high_speed = true;
+      }
+      respond(0);
+      queue_register(status);
+      return;
+    }
+
+    case 8: {
+      respond(idle);
+      std::array<hal::byte, 4> const r7{
+        0x00, 0x00, static_cast<hal::byte>((argument >> 8) & 0x0F),
+        static_cast<hal::byte>(argument & 0xFF)
+      };
+      queue(r7);
+      return;
+    }
+
+    case 9: {
+      respond(0);
+      queue_register(make_csd());
+      return;
+    }
+
+    case 10: {
+      respond(0);
+      queue_register(make_cid());
+      return;
+    }
+
+    case 12:
+      m_reads_pending = 0;
+      queue(stuff_byte);
+      respond(0);
+      m_busy = m_settings.stop_busy;
+      return;
+
+    case 13: {
+      respond(0);
+      queue(status_bits());
+      m_write_error = false;
+      return;
+    }
+
+    case 16:
+      respond(m_settings.high_capacity || argument == block_size
+                ? 0
+                : r1_parameter_error);
+      return;
+
+    case 17:
+    case 18:
+      if (!block_in_range(argument, block)) {
+        return;
+      }
+      respond(0);
+      m_read_block = block;
+      m_reads_pending = index == 17 ? 1 : stream_forever;
+      m_read_delay = m_settings.access_delay + std::exchange(m_read_stall, 0);
+      m_read_ready = m_clock->now() + m_settings.read_latency;
+      return;
+
+    case 24:
+    case 25:
+      if (!block_in_range(argument, block)) {
+        return;
+      }
+      respond(0);
+      m_write_block = block;
+      m_write_multiple = index == 25;
+      m_mode = receive_mode::write_token;
+      return;
+
+    case 32:
+    case 33:
+      if (!block_in_range(argument, block)) {
+        return;
+      }
+      (index == 32 ? m_erase_start : m_erase_end) = block;
+      respond(0);
+      return;
+
+    case 38: {
+      if (m_erase_end < m_erase_start) {
+        respond(r1_parameter_error);
+        return;
+      }
+      auto const first = m_image.begin() + m_erase_start * block_size;
+      auto const last = m_image.begin() + (m_erase_end + 1) * block_size;
+      std::fill(first, last, hal::byte{ 0x00 });
+      respond(0);
+      m_busy = m_settings.stop_busy;
+      return;
+    }
+
+    case 55:
+      if (m_reject_application > 0) {
+        m_reject_application--;
+        respond(idle | r1_illegal_command);
+        return;
+      }
+      m_application = true;
+      respond(idle);
+      return;
+
+    case 58: {
+      respond(idle);
+      hal::byte ocr = 0;
+      if (!m_idle) {
+        ocr = m_settings.high_capacity ? 0xC0 : 0x80;
+      }
+      std::array<hal::byte, 4> const r3{ ocr, 0xFF, 0x80, 0x00 };
+      queue(r3);
+      return;
+    }
+
+    case 59:
+      m_crc = (argument & 1) != 0;
+      respond(idle);
+      return;
+
+    default:
+      respond(idle | r1_illegal_command);
+      return;
+  }
+}
+
+void simulated_card::execute_application(hal::byte p_index, uint32_t p_argument)
+{
+  hal::byte const idle = m_idle ? r1_idle : 0;
+
+  switch (p_index) {
+    case 13: {
+      respond(idle);
+      queue(status_bits());
+      queue_register(make_sd_status());
+      return;
+    }
+
+    case 23:
+      m_pre_erase = p_argument & 0x7F'FFFF;
+      respond(idle);
+      return;
+
+    case 41: {
+      // High capacity cards never leave idle for hosts that do not set HCS
+      bool const host_capacity_support = (p_argument & (1UL << 30)) != 0;
+      bool const stuck = m_settings.high_capacity && !host_capacity_support;
+      if (m_idle && !stuck && m_init_count++ >= m_settings.init_attempts) {
+        m_idle = false;
+      }
+      respond(m_idle ? r1_idle : 0);
+      return;
+    }
+
+    case 51:
+      respond(idle);
+      queue_register(make_scr());
+      return;
+
+    default:
+      respond(idle | r1_illegal_command);
+      return;
+  }
+}
+
+void simulated_card::respond(hal::byte p_r1)
+{
+  auto const delay = std::min(
+    m_settings.response_delay + bytes_within(m_settings.command_latency),
+    max_response_delay);
+  for (std::size_t i = 0; i < delay; i++) {
+    queue(0xFF);
+  }
+  queue(p_r1);
+}
+
+void simulated_card::queue(hal::byte p_byte)
+{
+  if (m_output_size == m_output.size()) {
+    hal::safe_throw(hal::resource_unavailable_try_again(this));
+  }
+  m_output[(m_output_head + m_output_size) % m_output.size()] = p_byte;
+  m_output_size++;
+}
+
+void simulated_card::queue(std::span<hal::byte const> p_bytes)
+{
+  for (auto const value : p_bytes) {
+    queue(value);
+  }
+}
+
+void simulated_card::queue_block(std::span<hal::byte const> p_data)
+{
+  auto crc = crc16(p_data);
+  if (m_corrupt_reads > 0) {
+    m_corrupt_reads--;
+    crc = static_cast<uint16_t>(~crc);
+  }
+
+  queue(start_token);
+  queue(p_data);
+  queue(static_cast<hal::byte>(crc >> 8));
+  queue(static_cast<hal::byte>(crc & 0xFF));
+}
+
+void simulated_card::queue_register(std::span<hal::byte const> p_data)
+{
+  std::ranges::copy(p_data, m_register.begin());
+  m_register_length = p_data.size();
+  m_reads_pending = 1;
+  m_read_delay = m_settings.access_delay;
+}
+
+void simulated_card::clear_output()
+{
+  m_output_head = 0;
+  m_output_size = 0;
+  m_reads_pending = 0;
+  m_register_length = 0;
+}
+
+bool simulated_card::block_in_range(uint32_t p_argument, uint32_t& p_block)
+{
+  if (!m_settings.high_capacity && p_argument % block_size != 0) {
+    respond(r1_address_error);
+    return false;
+  }
+
+  p_block = m_settings.high_capacity ? p_argument : p_argument / block_size;
+  if (p_block >= m_image.size() / block_size) {
+    respond(r1_parameter_error);
+    return false;
+  }
+  return true;
+}
+
+hal::byte simulated_card::status_bits() const
+{
+  // R2 second byte, bit 2: general or unknown error
+  return m_write_error ? 0x04 : 0x00;
+}
+
+bool simulated_card::programming() const
+{
+  return m_busy > 0 || m_clock->now() < m_busy_until;
+}
+
+simulated_clock::duration simulated_card::byte_time() const
+{
+  if (m_clock_rate <= 0.0f) {
+    return {};
+  }
+  return simulated_clock::duration(8e9 / m_clock_rate);
+}
+
+std::size_t simulated_card::bytes_within(hal::time_duration p_duration) const
+{
+  auto const seconds = std::chrono::duration<double>(p_duration).count();
+  return static_cast<std::size_t>(std::ceil(seconds * m_clock_rate / 8.0));
+}
+
+hal::time_duration simulated_card::program_time(uint32_t p_block)
+{
+  auto busy = m_settings.program_time;
+
+  // Opening another AU costs the card a flash block allocation
+  auto const allocation_unit = static_cast<uint32_t>(
+    uint64_t{ p_block } * block_size / m_settings.allocation_unit);
+  if (m_written && allocation_unit != m_last_allocation_unit) {
+    busy += m_settings.allocation_unit_switch;
+    m_allocation_unit_switches++;
+  }
+  m_last_allocation_unit = allocation_unit;
+  m_written = true;
+
+  if (m_settings.gc_probability > 0.0) {
+    auto const range = static_cast<double>(m_random.max() - m_random.min());
+    auto const draw = static_cast<double>(m_random() - m_random.min()) / range;
+    if (draw < m_settings.gc_probability) {
+      busy += m_settings.gc_stall;
+      m_gc_stalls++;
+    }
+  }
+
+  return busy;
+}
+
+std::array<hal::byte, 16> simulated_card::make_csd() const
+{
+  std::array<hal::byte, 16> csd{};
+  auto const sectors = static_cast<uint32_t>(m_image.size() / block_size);
+
+  insert_bits(csd, 119, 112, 0x0E);  // TAAC: 1.0 ms
+  insert_bits(csd, 103, 96, 0x32);   // TRAN_SPEED: 25 MHz
+  insert_bits(csd, 95, 84, 0x5B5);   // CCC: classes 0, 2, 4, 5, 7, 8, 10
+  insert_bits(csd, 83, 80, 9);       // READ_BL_LEN: 512 bytes
+  insert_bits(csd, 46, 46, 1);       // ERASE_BLK_EN
+  insert_bits(csd, 45, 39, 0x7F);    // SECTOR_SIZE: 64 KiB
+  insert_bits(csd, 25, 22, 9);       // WRITE_BL_LEN: 512 bytes
+
+  if (m_settings.high_capacity) {
+    insert_bits(csd, 127, 126, 1);
+    insert_bits(csd, 69, 48, sectors / 1024 - 1);
+  } else {
+    // Capacity = (C_SIZE + 1) * 2^(C_SIZE_MULT + 2) blocks, so pick the
+    // smallest multiplier that keeps C_SIZE within its 12 bits.
+    uint32_t multiplier = 0;
+    while (multiplier < 7 && (sectors >> (multiplier + 2)) > 4096) {
+      multiplier++;
+    }
+    insert_bits(csd, 73, 62, (sectors >> (multiplier + 2)) - 1);
+    insert_bits(csd, 49, 47, multiplier);
+  }
+
+  seal_register(csd);
+  return csd;
+}
+
+std::array<hal::byte, 16> simulated_card::make_cid() const
+{
+  std::array<hal::byte, 16> cid{
+    0x03, 'S', 'D', 'S', 'I', 'M', 'U', 'L', 0x10, 0x12, 0x34, 0x56, 0x78,
+  };
+  insert_bits(cid, 19, 12, 23);  // 2023
+  insert_bits(cid, 11, 8, 10);   // October
+  seal_register(cid);
+  return cid;
+}
+
+std::array<hal::byte, 64> simulated_card::make_sd_status() const
+{
+  auto const au_code = allocation_unit_code(m_settings.allocation_unit);
+  std::array<hal::byte, 64> status{};
+  insert_bits(status, 447, 440, 4);        // SPEED_CLASS: class 10
+  insert_bits(status, 431, 428, au_code);  // AU_SIZE
+  insert_bits(status, 423, 408, 1);        // ERASE_SIZE: 1 AU
+  insert_bits(status, 407, 402, 2);        // ERASE_TIMEOUT: 2 s
+  insert_bits(status, 401, 400, 1);        // ERASE_OFFSET: 1 s
+  insert_bits(status, 399, 396, 1);        // UHS_SPEED_GRADE: U1
+  // UHS_AU_SIZE uses the AU_SIZE codes, but only from 1 MiB up
+  insert_bits(status, 395, 392, au_code >= 7 ? au_code : 0);
+  insert_bits(status, 391, 384, 10);  // VIDEO_SPEED_CLASS: V10
+  insert_bits(status, 339, 336, 1);   // APP_PERF_CLASS: A1
+  insert_bits(status, 313, 313, 1);   // DISCARD_SUPPORT
+  return status;
+}
+
+std::array<hal::byte, 8> simulated_card::make_scr() const
+{
+  std::array<hal::byte, 8> scr{};
+  insert_bits(scr, 59, 56, 2);    // SD_SPEC: 2.00 or later
+  insert_bits(scr, 51, 48, 0x5);  // SD_BUS_WIDTHS: 1 and 4 bit
+  insert_bits(scr, 35, 32, 0x2);  // CMD_SUPPORT: CMD23
+  return scr;
+}
+}  // namespace hal::sd
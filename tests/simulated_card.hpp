@@ -0,0 +1,293 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <span>
+
+#include <libhal/output_pin.hpp>
+#include <libhal/spi.hpp>
+#include <libhal/steady_clock.hpp>
+#include <libhal/units.hpp>
+
+namespace hal::sd {
+/**
+ * @brief Simulated time, advanced by the bytes clocked on simulated buses
+ *
+ * Cards on separate buses that are driven by one core should share a clock,
+ * as the time spent clocking one bus is time that passes for every card.
+ * Passing the same clock to microsd_card makes its timeouts run on simulated
+ * time as well.
+ */
+class simulated_clock : public hal::steady_clock
+{
+public:
+  using duration = std::chrono::duration<double, std::nano>;
+
+  /**
+   * @brief Move the clock forward
+   *
+   * @param p_duration - time that passed
+   */
+  void advance(duration p_duration);
+
+  /// Time passed since the clock was created
+  duration now() const;
+
+private:
+  hal::hertz driver_frequency() override;
+  std::uint64_t driver_uptime() override;
+
+  duration m_now{};
+};
+
+/**
+ * @brief SPI-mode SD card model backed by a memory image
+ *
+ * Implements hal::spi so microsd_card, and anything built on it, can run on a
+ * host without hardware. The card is selected through chip_select(). Every
+ * byte clocked while selected is decoded the way a real card would: command
+ * frames, data tokens, CRCs, the R1/R1b/R2/R3/R7 responses and busy signalling
+ * are all modelled, including the gaps (NCR, NAC) between them.
+ *
+ * Supported commands: CMD0, 6, 8, 9, 10, 12, 13, 16, 17, 18, 24, 25, 32, 33,
+ * 38, 55, 58, 59 and ACMD13, 23, 41, 51.
+ *
+ * Each byte clocked advances the card's simulated_clock by 8 cycles at the
+ * configured clock rate. The latencies and busy times in settings are
+ * measured on that clock, so reading clock().now() after a transfer gives its
+ * duration at that bus rate and throughput can be compared between access
+ * patterns.
+ */
+class simulated_card : public hal::spi
+{
+public:
+  struct settings
+  {
+    /// SDHC (block addressed, CSD v2) when true, SDSC (byte addressed, CSD
+    /// v1) when false
+    bool high_capacity = true;
+    /// Accept CMD6 switches to High-Speed mode
+    bool high_speed = true;
+    /// Filler bytes between the end of a command and its R1 (NCR), 0 to 8
+    hal::byte response_delay = 1;
+    /// Filler bytes between R1 and a data block's start token (NAC)
+    std::size_t access_delay = 2;
+    /// Busy bytes after each written block
+    std::size_t program_busy = 4;
+    /// Busy bytes after CMD12, the stop token or CMD38
+    std::size_t stop_busy = 2;
+    /// Number of ACMD41s answered with "idle" before the card is ready
+    int init_attempts = 2;
+
+    /// Time from the end of a command to its R1, added to response_delay.
+    /// The response never comes later than the 8 bytes allowed for NCR.
+    hal::time_duration command_latency{};
+    /// Time from a read command, or from the previous block of a CMD18, until
+    /// the next data block is ready, on top of access_delay
+    hal::time_duration read_latency{};
+    /// Time each written block keeps the card busy, on top of program_busy
+    hal::time_duration program_time{};
+    /// Size of an allocation unit (AU) in bytes, reported in the SD Status
+    std::size_t allocation_unit = 4 * 1024 * 1024;
+    /// Extra busy time when a block is written to a different AU than the
+    /// block written before it
+    hal::time_duration allocation_unit_switch{};
+    /// Chance, from 0 to 1, that a written block triggers garbage collection
+    double gc_probability = 0.0;
+    /// Extra busy time of a block that triggers garbage collection
+    hal::time_duration gc_stall{};
+    /// Seed of the generator deciding which blocks trigger garbage collection
+    std::uint32_t seed = 1;
+  };
+
+  /**
+   * @param p_image - card contents, a multiple of 512 bytes. SDHC images
+   * must be a multiple of 512 KiB.
+   */
+  explicit simulated_card(std::span<hal::byte> p_image);
+  simulated_card(std::span<hal::byte> p_image, settings const& p_settings);
+
+  /**
+   * @param p_image - card contents, a multiple of 512 bytes
+   * @param p_settings - card behaviour and timing
+   * @param p_clock - clock shared with other simulated cards
+   */
+  simulated_card(std::span<hal::byte> p_image,
+                 settings const& p_settings,
+                 simulated_clock& p_clock);
+
+  /// Chip select line of the card, active low
+  hal::output_pin& chip_select();
+
+  /// Clock the card's timing runs on
+  simulated_clock& clock();
+
+  /// Bytes clocked while the card was selected
+  std::uint64_t bytes_clocked() const;
+  /// SPI clock cycles on the card's bus, whether it was selected or not
+  std::uint64_t clock_cycles() const;
+  /// Written blocks that landed in a different AU than the one before
+  std::uint32_t allocation_unit_switches() const;
+  /// Written blocks that triggered garbage collection
+  std::uint32_t gc_stalls() const;
+  /// Number of times chip select was asserted
+  std::uint32_t select_count() const;
+  /// Command frames received
+  std::uint32_t command_count() const;
+  /// Commands or tokens the host sent while the card could not accept them
+  std::uint32_t protocol_errors() const;
+  /// Clock rate of the most recent configure()
+  hal::hertz clock_rate() const;
+  /// CRC checking was turned on with CMD59
+  bool crc_enabled() const;
+  /// Card was switched to High-Speed mode with CMD6
+  bool high_speed_enabled() const;
+  /// Block count of the most recent ACMD23
+  std::uint32_t pre_erase_count() const;
+
+  /// Send the next p_count data blocks with a corrupted CRC16
+  void corrupt_reads(int p_count);
+  /// Answer the next p_count written blocks with a CRC error, as if they had
+  /// been corrupted on the way to the card
+  void corrupt_writes(int p_count);
+  /// Reject the next p_count written blocks with a write error
+  void fail_writes(int p_count);
+  /// Accept the next p_count written blocks but fail to program them, which
+  /// only shows up in the card status
+  void lose_writes(int p_count);
+  /// Hold back the next data block sent to the host by p_bytes of filler
+  void stall_next_read(std::size_t p_bytes);
+  /// Answer the next p_count CMD55 as an illegal command, so the command that
+  /// follows is not taken as an application command
+  void reject_application_commands(int p_count);
+
+private:
+  class select_pin : public hal::output_pin
+  {
+  public:
+    explicit select_pin(simulated_card& p_card);
+
+  private:
+    void driver_configure(hal::output_pin::settings const& p_settings) override;
+    void driver_level(bool p_high) override;
+    bool driver_level() override;
+
+    simulated_card* m_card;
+    bool m_level = true;
+  };
+
+  enum class receive_mode : hal::byte
+  {
+    command,
+    write_token,
+    write_data,
+  };
+
+  void driver_configure(hal::spi::settings const& p_settings) override;
+  void driver_transfer(std::span<hal::byte const> p_data_out,
+                       std::span<hal::byte> p_data_in,
+                       hal::byte p_filler) override;
+
+  void select(bool p_selected);
+  hal::byte exchange(hal::byte p_mosi);
+  hal::byte next_output();
+  void receive(hal::byte p_mosi);
+  void execute(std::array<hal::byte, 6> const& p_frame);
+  void execute_application(hal::byte p_index, uint32_t p_argument);
+  void receive_block();
+
+  void respond(hal::byte p_r1);
+  void queue(hal::byte p_byte);
+  void queue(std::span<hal::byte const> p_bytes);
+  void queue_block(std::span<hal::byte const> p_data);
+  void queue_register(std::span<hal::byte const> p_data);
+  void clear_output();
+  bool block_in_range(uint32_t p_argument, uint32_t& p_block);
+  hal::byte status_bits() const;
+  bool programming() const;
+  simulated_clock::duration byte_time() const;
+  std::size_t bytes_within(hal::time_duration p_duration) const;
+  hal::time_duration program_time(uint32_t p_block);
+
+  std::array<hal::byte, 16> make_csd() const;
+  std::array<hal::byte, 16> make_cid() const;
+  std::array<hal::byte, 8> make_scr() const;
+  std::array<hal::byte, 64> make_sd_status() const;
+
+  std::span<hal::byte> m_image;
+  settings m_settings;
+  select_pin m_chip_select;
+  hal::hertz m_clock_rate = 0.0f;
+  simulated_clock m_own_clock;
+  simulated_clock* m_clock;
+  std::minstd_rand m_random;
+
+  // Host to card
+  bool m_selected = false;
+  receive_mode m_mode = receive_mode::command;
+  std::array<hal::byte, 6> m_frame{};
+  std::size_t m_frame_length = 0;
+  std::array<hal::byte, 514> m_block{};
+  std::size_t m_block_length = 0;
+  uint32_t m_write_block = 0;
+  bool m_write_multiple = false;
+
+  // Card to host
+  std::array<hal::byte, 1024> m_output{};
+  std::size_t m_output_head = 0;
+  std::size_t m_output_size = 0;
+  std::size_t m_busy = 0;
+  simulated_clock::duration m_busy_until{};
+  std::size_t m_read_delay = 0;
+  simulated_clock::duration m_read_ready{};
+  uint32_t m_read_block = 0;
+  uint32_t m_reads_pending = 0;
+  std::array<hal::byte, 64> m_register{};
+  std::size_t m_register_length = 0;
+
+  // Card state
+  bool m_idle = true;
+  bool m_application = false;
+  bool m_crc = false;
+  bool m_high_speed = false;
+  int m_init_count = 0;
+  uint32_t m_erase_start = 0;
+  uint32_t m_erase_end = 0;
+  uint32_t m_pre_erase = 0;
+  bool m_write_error = false;
+  int m_corrupt_reads = 0;
+  int m_corrupt_writes = 0;
+  int m_fail_writes = 0;
+  int m_lose_writes = 0;
+  int m_reject_application = 0;
+  std::size_t m_read_stall = 0;
+  uint32_t m_last_allocation_unit = 0;
+  bool m_written = false;
+
+  // Statistics
+  std::uint64_t m_bytes_clocked = 0;
+  std::uint64_t m_clock_cycles = 0;
+  std::uint32_t m_allocation_unit_switches = 0;
+  std::uint32_t m_gc_stalls = 0;
+  std::uint32_t m_commands = 0;
+  std::uint32_t m_selections = 0;
+  std::uint32_t m_protocol_errors = 0;
+};
+}  // namespace hal::sd